@@ -0,0 +1,122 @@
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "CacheStorage.hpp"
+
+// Shared by every thread of a run, created and destroyed by the setup and teardown hooks
+static std::unique_ptr<CacheStorage> cache;
+
+/// Builds the requests for keys [0, count)
+/// @param count number of distinct keys
+static std::vector<HTTPMessage> makeRequests(int count)
+{
+    std::vector<HTTPMessage> requests;
+    requests.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        requests.emplace_back("GET /object/" + std::to_string(i) + " HTTP/1.1\r\nHost: example.com\r\n\r\n");
+    }
+    return requests;
+}
+
+/// Builds a response that the cache stores without compressing it
+/// @param body_size length of the body
+static HTTPMessage makeResponse(size_t body_size)
+{
+    return HTTPMessage("HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " +
+                       std::to_string(body_size) + "\r\n\r\n" + std::string(body_size, 'a'));
+}
+
+/// Creates a cache holding range(0) cells
+static void setupCache(const benchmark::State &state)
+{
+    ProxyConfig config;
+    config.cache_size = state.range(0);
+    cache = std::make_unique<CacheStorage>(config);
+}
+
+/// Creates a cache holding range(0) cells and stores a response of range(1) bytes for every key, so every lookup of
+/// a run hits from the first iteration on every thread
+static void setupFilledCache(const benchmark::State &state)
+{
+    setupCache(state);
+    std::vector<HTTPMessage> requests = makeRequests(state.range(0));
+    HTTPMessage response = makeResponse(state.range(1));
+    for (HTTPMessage &request : requests)
+    {
+        cache->insertItem(request, response);
+    }
+}
+
+static void teardownCache(const benchmark::State &)
+{
+    cache.reset();
+}
+
+/// Rewrites keys that already have a cell, every thread on its own keys
+static void BM_CacheInsert(benchmark::State &state)
+{
+    int keys = state.range(0) / state.threads();
+    std::vector<HTTPMessage> requests = makeRequests(state.range(0));
+    HTTPMessage response = makeResponse(state.range(1));
+    for (int i = 0; i < keys; i++)
+    {
+        cache->insertItem(requests[state.thread_index() * keys + i], response);
+    }
+    int next = 0;
+    for (auto _ : state)
+    {
+        cache->insertItem(requests[state.thread_index() * keys + next], response);
+        next = (next + 1) % keys;
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+
+/// Inserts keys that are never cached yet, so every insert evicts the least recently used cell
+static void BM_CacheEvict(benchmark::State &state)
+{
+    std::vector<HTTPMessage> requests = makeRequests(state.range(0) * 4);
+    HTTPMessage response = makeResponse(state.range(1));
+    size_t next = state.thread_index();
+    for (auto _ : state)
+    {
+        cache->insertItem(requests[next % requests.size()], response);
+        next += state.threads();
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+
+/// Looks up keys cycling over every cell, the hot and memory tiers fill as they are hit
+static void BM_CacheLookup(benchmark::State &state)
+{
+    std::vector<HTTPMessage> requests = makeRequests(state.range(0));
+    size_t next = state.thread_index();
+    int64_t misses = 0;
+    for (auto _ : state)
+    {
+        HTTPMessage &request = requests[next % requests.size()];
+        std::optional<CacheHit> hit = cache->lookupItem(request);
+        std::optional<HTTPMessage> response = hit ? cache->readItem(*hit) : std::nullopt;
+        misses += !response;
+        benchmark::DoNotOptimize(response);
+        next += state.threads();
+    }
+    state.counters["misses"] = benchmark::Counter(misses, benchmark::Counter::kAvgThreads);
+    state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+
+static void cacheArguments(benchmark::internal::Benchmark *benchmark)
+{
+    benchmark->ArgNames({"cells", "body"})
+        ->ArgsProduct({{64, 1024}, {1024, 64 * 1024}})
+        ->ThreadRange(1, 8)
+        ->UseRealTime()
+        ->Teardown(teardownCache);
+}
+
+BENCHMARK(BM_CacheInsert)->Apply(cacheArguments)->Setup(setupCache);
+BENCHMARK(BM_CacheEvict)->Apply(cacheArguments)->Setup(setupCache);
+BENCHMARK(BM_CacheLookup)->Apply(cacheArguments)->Setup(setupFilledCache);
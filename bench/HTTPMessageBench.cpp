@@ -0,0 +1,103 @@
+#include <benchmark/benchmark.h>
+
+#include <ctime>
+#include <string>
+
+#include "HTTPMessage.hpp"
+
+/// Builds a request with the given number of extra headers, Host is always last
+/// @param header_count extra headers before Host
+static std::string makeRequest(int header_count)
+{
+    std::string text = "GET /index.html HTTP/1.1\r\n";
+    for (int i = 0; i < header_count; i++)
+    {
+        text += "X-Header-" + std::to_string(i) + ": value-" + std::to_string(i) + "\r\n";
+    }
+    return text + "Host: example.com\r\n\r\n";
+}
+
+/// Builds a complete response with a body of the given size
+/// @param body_size length of the body
+/// @param chunked send the body with the chunked transfer coding instead of Content-Length
+static std::string makeResponse(size_t body_size, bool chunked)
+{
+    std::string body(body_size, 'a');
+    std::string text = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+    if (chunked)
+    {
+        char size[32];
+        snprintf(size, sizeof(size), "%zx", body_size);
+        return text + "Transfer-Encoding: chunked\r\n\r\n" + size + "\r\n" + body + "\r\n0\r\n\r\n";
+    }
+    return text + "Content-Length: " + std::to_string(body_size) + "\r\n\r\n" + body;
+}
+
+static void BM_ParseHeader(benchmark::State &state)
+{
+    std::string text = makeRequest(state.range(0));
+    for (auto _ : state)
+    {
+        HTTPMessage msg(text);
+        benchmark::DoNotOptimize(msg.getHeader("Host"));
+    }
+    state.SetBytesProcessed(state.iterations() * text.length());
+}
+BENCHMARK(BM_ParseHeader)->RangeMultiplier(4)->Range(1, 256);
+
+static void BM_GetRemainingLength(benchmark::State &state)
+{
+    HTTPMessage msg(makeResponse(state.range(0), state.range(1)));
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(msg.getRemainingLength());
+    }
+}
+BENCHMARK(BM_GetRemainingLength)->ArgsProduct({benchmark::CreateRange(64, 1 << 20, 16), {0, 1}});
+
+/// Feeds a response in recv sized pieces and checks completion after each one, like the socket receive loops
+static void BM_ReceiveLoop(benchmark::State &state)
+{
+    std::string text = makeResponse(state.range(0), state.range(1));
+    const size_t recv_size = 1024;
+    for (auto _ : state)
+    {
+        HTTPMessage msg("");
+        std::string received;
+        for (size_t offset = 0; offset < text.length(); offset += recv_size)
+        {
+            received.append(text, offset, recv_size);
+            msg = HTTPMessage(received);
+            if (msg.getRemainingLength() <= 0)
+            {
+                break;
+            }
+        }
+        benchmark::DoNotOptimize(msg);
+    }
+    state.SetBytesProcessed(state.iterations() * text.length());
+}
+BENCHMARK(BM_ReceiveLoop)->ArgsProduct({benchmark::CreateRange(1024, 256 * 1024, 4), {0, 1}});
+
+static void BM_AddIffModifiedSince(benchmark::State &state)
+{
+    std::string text = makeRequest(state.range(0));
+    std::time_t timestamp = 1700000000;
+    for (auto _ : state)
+    {
+        HTTPMessage msg(text);
+        msg.addIffModifiedSince(timestamp);
+        benchmark::DoNotOptimize(msg.to_string());
+    }
+}
+BENCHMARK(BM_AddIffModifiedSince)->Arg(4)->Arg(64);
+
+static void BM_GetStatusCode(benchmark::State &state)
+{
+    HTTPMessage msg(makeResponse(state.range(0), false));
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(msg.getStatusCode());
+    }
+}
+BENCHMARK(BM_GetStatusCode)->Arg(64)->Arg(64 * 1024);
@@ -0,0 +1,88 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+
+#include "CacheStorage.hpp"
+
+static constexpr int KEY_COUNT = 16;
+
+/// Stops the run with a message, the fuzzer keeps the input that caused it
+/// @param what broken property
+/// @param key key being checked
+static void fail(const char *what, int key)
+{
+    fprintf(stderr, "Cache model mismatch on key %d: %s\n", key, what);
+    abort();
+}
+
+/// Runs a sequence of operations against a small cache and a map holding the last response stored for each key.
+/// Any hit must return exactly the last stored response, and the key inserted last must always hit, since nothing
+/// could have evicted it yet. Other keys may miss, the cache is smaller than the key space.
+/// Every operation takes three bytes: the operation, the key and a variant of the response.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    ProxyConfig config;
+    config.cache_size = 4;
+    config.memory_budget = 8 * 1024;
+    config.hot_slot_count = 2;
+    config.hot_max_object_size = 1024;
+    CacheStorage cache(config);
+    std::map<int, std::string> model;
+    int last_inserted = -1;
+
+    for (size_t i = 0; i + 3 <= size; i += 3)
+    {
+        int operation = data[i] % 4;
+        int key = data[i + 1] % KEY_COUNT;
+        int variant = data[i + 2];
+        HTTPMessage request("GET /object/" + std::to_string(key) + " HTTP/1.1\r\nHost: example.com\r\n\r\n");
+
+        if (operation <= 1)
+        {
+            // Half the responses are text, which the cache stores compressed once they are large enough
+            std::string body = std::string(variant * 16, 'a' + key) + std::to_string(variant);
+            int status = variant % 16 == 15 ? 304 : 200;
+            HTTPMessage response("HTTP/1.1 " + std::to_string(status) + " OK\r\nContent-Type: " +
+                                 (operation == 0 ? "text/plain" : "application/octet-stream") +
+                                 "\r\nContent-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body);
+            cache.insertItem(request, response);
+            if (status == 200)
+            {
+                model[key] = body;
+                last_inserted = key;
+            }
+        }
+        else if (operation == 2)
+        {
+            std::optional<CacheHit> hit = cache.lookupItem(request);
+            std::optional<HTTPMessage> response = hit ? cache.readItem(*hit) : std::nullopt;
+            if (!response)
+            {
+                if (key == last_inserted)
+                {
+                    fail("last inserted key missed", key);
+                }
+                continue;
+            }
+            auto expected = model.find(key);
+            if (expected == model.end())
+            {
+                fail("hit on a key that was never stored", key);
+            }
+            // Text is stored compressed, the request accepts no coding so it is served decompressed
+            HTTPMessage served = ContentEncoding::negotiate(*response, request);
+            if (served.getStatusCode() != 200 || served.getBody() != expected->second)
+            {
+                fail("hit returned a response other than the last one stored", key);
+            }
+        }
+        else
+        {
+            cache.refreshItem(request);
+        }
+    }
+    return 0;
+}
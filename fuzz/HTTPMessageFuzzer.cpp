@@ -0,0 +1,45 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "ByteRange.hpp"
+#include "ContentEncoding.hpp"
+#include "HTTPMessage.hpp"
+
+/// Feeds arbitrary bytes to the parser as both a request and a response and calls everything the proxy calls on
+/// untrusted messages
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    std::string text(reinterpret_cast<const char *>(data), size);
+    HTTPMessage msg(text);
+    msg.isEmpty();
+    msg.getMethod();
+    msg.getTarget();
+    msg.hostName();
+    msg.hostPort(80);
+    msg.getHeader("Content-Length");
+    msg.getHeader("Transfer-Encoding");
+    msg.getBody();
+    msg.getStatusCode();
+    msg.getRemainingLength();
+    HTTPMessage::splitAuthority(msg.getHeader("Host"), 80);
+
+    // The request derived parts of the proxy
+    HTTPMessage request(msg);
+    request.removeHeader("Range");
+    request.setHeader("Accept-Encoding", "gzip");
+    request.addIffModifiedSince(0);
+
+    // The response derived parts, with a request that asks for ranges and gzip
+    HTTPMessage client("GET / HTTP/1.1\r\nHost: example.com\r\nRange: bytes=0-1,-2\r\nAccept-Encoding: gzip\r\n\r\n");
+    if (ContentEncoding::isCompressible(msg))
+    {
+        ContentEncoding::negotiate(ContentEncoding::compress(msg), client);
+    }
+    ContentEncoding::negotiate(msg, client);
+    ContentEncoding::streamDecoded(msg, [](const std::string &) { return true; });
+    ContentEncoding::gunzip(text, [](const char *, size_t) {});
+    ByteRange::serve(msg, client);
+    ByteRange::serve(client, msg);
+    return 0;
+}
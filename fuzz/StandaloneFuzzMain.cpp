@@ -0,0 +1,52 @@
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/// Runs one input file through the fuzz target
+/// @param path file to run
+static void runFile(const std::filesystem::path &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::vector<char> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::cout << "Running " << path.string() << " (" << input.size() << " bytes)" << std::endl;
+    LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+}
+
+/// Replays inputs through a fuzz target for compilers without libFuzzer. Pair it with the sanitizers to catch
+/// crashes in a corpus or in inputs saved by a fuzzing run elsewhere.
+/// @param argc argument count
+/// @param argv files or directories of files to run
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cout << "Usage: " << argv[0] << " <file or directory>..." << std::endl;
+        return 1;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        std::filesystem::path path = argv[i];
+        if (std::filesystem::is_directory(path))
+        {
+            for (const auto &entry : std::filesystem::recursive_directory_iterator(path))
+            {
+                if (entry.is_regular_file())
+                {
+                    runFile(entry.path());
+                }
+            }
+        }
+        else
+        {
+            runFile(path);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "GlobalItems.hpp"
+#include "ProxyConfig.hpp"
+
+typedef std::chrono::steady_clock::time_point SteadyTime;
+
+/// Allows a steady rate of requests with bursts, each request takes a token
+struct TokenBucket
+{
+    double tokens = 0;
+    SteadyTime refilled;
+    bool used = false;
+
+    bool take(int rate, int burst, SteadyTime now);
+    bool idle(int rate, int burst, SteadyTime now) const;
+};
+
+/// Refills the tokens earned since the last request and takes one
+/// @param rate tokens earned per second
+/// @param burst most tokens the bucket holds, a new bucket starts full
+/// @param now current time
+/// @return false if the bucket is empty
+bool TokenBucket::take(int rate, int burst, SteadyTime now)
+{
+    double elapsed = std::chrono::duration<double>(now - refilled).count();
+    tokens = used ? std::min<double>(burst, tokens + elapsed * rate) : burst;
+    refilled = now;
+    used = true;
+    if (tokens < 1)
+    {
+        return false;
+    }
+    tokens--;
+    return true;
+}
+
+/// Returns true if the bucket has refilled completely, it can then be dropped and started over
+bool TokenBucket::idle(int rate, int burst, SteadyTime now) const
+{
+    return !used || tokens + std::chrono::duration<double>(now - refilled).count() * rate >= burst;
+}
+
+enum class BreakerState
+{
+    Closed,   // Requests go through
+    Open,     // Requests fail fast
+    HalfOpen  // One probe request decides whether the breaker closes again
+};
+
+/// Outcome of asking to send a request to an origin
+enum class Admission
+{
+    Admitted,
+    Busy,        // Too many requests to the origin in flight
+    RateLimited, // The origin's request rate is used up
+    CircuitOpen  // The origin is failing
+};
+
+/// Limits, breaker and counters of one origin, guarded by AdmissionControl::origins_lock
+struct OriginState
+{
+    int active = 0;
+    TokenBucket bucket;
+    BreakerState breaker = BreakerState::Closed;
+    SteadyTime opened_at;
+    bool probing = false; // A half open probe is in flight
+    SteadyTime last_used;
+
+    // Current breaker window
+    SteadyTime window_start;
+    int window_requests = 0;
+    int window_failures = 0;
+
+    // Totals since startup
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t busy = 0;
+    uint64_t rate_limited = 0;
+    uint64_t short_circuited = 0;
+    uint64_t stale_served = 0;
+    uint64_t trips = 0;
+    uint64_t latency_total_ms = 0;
+    int64_t latency_max_ms = 0;
+};
+
+/// Keeps one client or origin from using up the proxy: caps the connections served at once, rate limits client
+/// addresses and origins, caps the requests in flight to each origin and stops sending requests to failing origins
+class AdmissionControl
+{
+    static constexpr size_t MAX_TRACKED = 4096; // Idle clients and origins are forgotten past this many
+
+    std::unordered_map<std::string, OriginState> origins;
+    std::mutex origins_lock;
+    std::unordered_map<std::string, TokenBucket> clients;
+    std::mutex clients_lock;
+    std::atomic<int> open_clients{0};
+    std::atomic<uint64_t> refused_clients{0};
+    std::atomic<uint64_t> rate_limited_clients{0};
+
+    void pruneOrigins(const ProxyConfig &config, SteadyTime now);
+
+  public:
+    bool openClient(const ProxyConfig &config);
+    void closeClient();
+    bool admitClient(const std::string &address, const ProxyConfig &config);
+    Admission admitOrigin(const std::string &origin, const ProxyConfig &config, bool &probe);
+    void release(const std::string &origin, bool probe, bool failed, std::chrono::milliseconds latency,
+                 const ProxyConfig &config);
+    void recordStale(const std::string &origin);
+    void logStats();
+
+    static const char *admissionName(Admission admission);
+};
+
+/// Counts a connection about to be served
+/// @param config configuration the connection runs with
+/// @return false if max_clients connections are already being served, the connection must then be refused
+bool AdmissionControl::openClient(const ProxyConfig &config)
+{
+    if (config.max_clients <= 0)
+    {
+        open_clients++;
+        return true;
+    }
+    // The check and the increment are one step, so accept threads racing for the last slot can't both take it
+    int open = open_clients.load();
+    do
+    {
+        if (open >= config.max_clients)
+        {
+            refused_clients++;
+            return false;
+        }
+    } while (!open_clients.compare_exchange_weak(open, open + 1));
+    return true;
+}
+
+void AdmissionControl::closeClient()
+{
+    open_clients--;
+}
+
+/// Takes a request from a client address out of its rate
+/// @param address client address
+/// @param config configuration the connection runs with
+/// @return false if the client sends faster than client_rate
+bool AdmissionControl::admitClient(const std::string &address, const ProxyConfig &config)
+{
+    if (config.client_rate <= 0)
+    {
+        return true;
+    }
+    SteadyTime now = std::chrono::steady_clock::now();
+    clients_lock.lock();
+    if (clients.size() >= MAX_TRACKED)
+    {
+        for (auto client = clients.begin(); client != clients.end();)
+        {
+            client = client->second.idle(config.client_rate, config.client_burst, now) ? clients.erase(client)
+                                                                                        : std::next(client);
+        }
+    }
+    bool admitted = clients[address].take(config.client_rate, config.client_burst, now);
+    clients_lock.unlock();
+    if (!admitted)
+    {
+        rate_limited_clients++;
+    }
+    return admitted;
+}
+
+/// Forgets origins that have nothing in flight and nothing to remember, origins_lock must be held
+/// @param config current configuration
+/// @param now current time
+void AdmissionControl::pruneOrigins(const ProxyConfig &config, SteadyTime now)
+{
+    for (auto origin = origins.begin(); origin != origins.end();)
+    {
+        OriginState &state = origin->second;
+        bool forgettable = state.active == 0 && state.breaker == BreakerState::Closed &&
+                           now - state.last_used >= std::chrono::milliseconds(config.breaker_window_ms) &&
+                           state.bucket.idle(config.origin_rate, config.origin_burst, now);
+        origin = forgettable ? origins.erase(origin) : std::next(origin);
+    }
+}
+
+/// Decides whether a request may be sent to an origin. Every admitted request must be released.
+/// @param origin host and port of the origin
+/// @param config configuration the connection runs with
+/// @param probe set if the request is the probe of a half open breaker, it must be passed on to release
+Admission AdmissionControl::admitOrigin(const std::string &origin, const ProxyConfig &config, bool &probe)
+{
+    probe = false;
+    SteadyTime now = std::chrono::steady_clock::now();
+    origins_lock.lock();
+    if (origins.size() >= MAX_TRACKED && origins.count(origin) == 0)
+    {
+        pruneOrigins(config, now);
+    }
+    OriginState &state = origins[origin];
+    state.last_used = now;
+    Admission admission = Admission::Admitted;
+    if (state.breaker == BreakerState::Open &&
+        now - state.opened_at >= std::chrono::milliseconds(config.breaker_open_ms))
+    {
+        state.breaker = BreakerState::HalfOpen;
+        state.probing = false;
+    }
+    if (state.breaker == BreakerState::Open || (state.breaker == BreakerState::HalfOpen && state.probing))
+    {
+        state.short_circuited++;
+        admission = Admission::CircuitOpen;
+    }
+    else if (config.origin_max_concurrency > 0 && state.active >= config.origin_max_concurrency)
+    {
+        state.busy++;
+        admission = Admission::Busy;
+    }
+    else if (config.origin_rate > 0 && !state.bucket.take(config.origin_rate, config.origin_burst, now))
+    {
+        state.rate_limited++;
+        admission = Admission::RateLimited;
+    }
+    else
+    {
+        probe = state.breaker == BreakerState::HalfOpen;
+        state.probing = probe;
+        state.active++;
+        state.requests++;
+    }
+    origins_lock.unlock();
+    return admission;
+}
+
+/// Records the outcome of an admitted request and moves the origin's breaker
+/// @param origin host and port of the origin
+/// @param probe the request was admitted as the probe of a half open breaker
+/// @param failed the origin could not be reached, timed out or answered with a server error
+/// @param latency time from admission until the response was received
+/// @param config configuration the connection runs with
+void AdmissionControl::release(const std::string &origin, bool probe, bool failed,
+                               std::chrono::milliseconds latency, const ProxyConfig &config)
+{
+    SteadyTime now = std::chrono::steady_clock::now();
+    bool bad = failed || (config.breaker_slow_ms > 0 && latency.count() >= config.breaker_slow_ms);
+    origins_lock.lock();
+    OriginState &state = origins[origin];
+    state.active--;
+    state.failures += bad;
+    state.latency_total_ms += latency.count();
+    state.latency_max_ms = std::max<int64_t>(state.latency_max_ms, latency.count());
+    bool opened = false;
+    // Only the probe decides a half open breaker, requests admitted before it opened don't count
+    if (probe && state.breaker == BreakerState::HalfOpen)
+    {
+        state.probing = false;
+        state.breaker = bad ? BreakerState::Open : BreakerState::Closed;
+        opened = bad;
+        state.window_start = now;
+        state.window_requests = 0;
+        state.window_failures = 0;
+    }
+    else if (state.breaker == BreakerState::Closed && config.breaker_error_percent > 0)
+    {
+        if (now - state.window_start >= std::chrono::milliseconds(config.breaker_window_ms))
+        {
+            state.window_start = now;
+            state.window_requests = 0;
+            state.window_failures = 0;
+        }
+        state.window_requests++;
+        state.window_failures += bad;
+        opened = state.window_requests >= config.breaker_min_requests &&
+                 state.window_failures * 100 >= config.breaker_error_percent * state.window_requests;
+        if (opened)
+        {
+            state.breaker = BreakerState::Open;
+        }
+    }
+    if (opened)
+    {
+        state.opened_at = now;
+        state.trips++;
+    }
+    origins_lock.unlock();
+    if (opened)
+    {
+        GFD::threadedCout("Circuit opened for origin ", origin);
+    }
+}
+
+/// Counts a stale cached response served in place of a rejected request
+/// @param origin host and port of the origin
+void AdmissionControl::recordStale(const std::string &origin)
+{
+    origins_lock.lock();
+    origins[origin].stale_served++;
+    origins_lock.unlock();
+}
+
+const char *AdmissionControl::admissionName(Admission admission)
+{
+    static const char *names[] = {"admitted", "busy", "rate limited", "circuit open"};
+    return names[(int)admission];
+}
+
+/// Prints the connection counters and the state and counters of every origin
+void AdmissionControl::logStats()
+{
+    static const char *breaker_names[] = {"closed", "open", "half open"};
+    GFD::threadedCout("Clients open: ", open_clients.load(), " refused: ", refused_clients.load(),
+                      " rate limited: ", rate_limited_clients.load());
+    origins_lock.lock();
+    for (auto &origin : origins)
+    {
+        const OriginState &state = origin.second;
+        uint64_t completed = state.requests - state.active;
+        GFD::threadedCout("Origin ", origin.first, ": breaker ", breaker_names[(int)state.breaker],
+                          ", active: ", state.active, " requests: ", state.requests, " failures: ", state.failures,
+                          " busy: ", state.busy, " rate limited: ", state.rate_limited,
+                          " short circuited: ", state.short_circuited, " stale served: ", state.stale_served,
+                          " trips: ", state.trips, ", latency avg: ",
+                          completed ? state.latency_total_ms / completed : 0,
+                          " ms max: ", state.latency_max_ms, " ms");
+    }
+    origins_lock.unlock();
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "HTTPMessage.hpp"
+
+typedef std::pair<size_t, size_t> ByteSpan; // First and last byte, inclusive
+
+/// Serves Range requests by slicing a complete response
+class ByteRange
+{
+    static constexpr size_t MAX_RANGES = 16;
+    static constexpr const char *BOUNDARY = "wi_proxy_byteranges";
+
+    static bool parse(const std::string &header, size_t length, std::vector<ByteSpan> &spans);
+    static bool ifRangeMatches(const HTTPMessage &full, const HTTPMessage &request);
+    static std::string withStatus(const HTTPMessage &full, const std::string &status);
+    static std::string contentRange(const ByteSpan &span, size_t length);
+
+  public:
+    static HTTPMessage serve(const HTTPMessage &full, const HTTPMessage &request);
+};
+
+/// Parses a Range header into spans clamped to the body length
+/// @param header value of the Range header
+/// @param length length of the full body
+/// @param spans receives the satisfiable spans
+/// @return false if the header is malformed and should be ignored
+bool ByteRange::parse(const std::string &header, size_t length, std::vector<ByteSpan> &spans)
+{
+    const std::string unit = "bytes=";
+    if (header.rfind(unit, 0) != 0)
+    {
+        return false;
+    }
+    std::stringstream ranges(header.substr(unit.length()));
+    std::string range;
+    size_t count = 0;
+    while (std::getline(ranges, range, ','))
+    {
+        if (++count > MAX_RANGES)
+        {
+            return false;
+        }
+        range.erase(0, range.find_first_not_of(' '));
+        range.erase(range.find_last_not_of(' ') + 1);
+        size_t dash = range.find('-');
+        if (dash == std::string::npos || range.find_first_not_of("0123456789-") != std::string::npos)
+        {
+            return false;
+        }
+        std::string first = range.substr(0, dash);
+        std::string last = range.substr(dash + 1);
+        if (first.empty())
+        {
+            // Suffix range: the final N bytes
+            size_t suffix = std::strtoull(last.c_str(), nullptr, 10);
+            if (last.empty())
+            {
+                return false;
+            }
+            if (suffix > 0 && length > 0)
+            {
+                spans.push_back({length - std::min(suffix, length), length - 1});
+            }
+            continue;
+        }
+        size_t start = std::strtoull(first.c_str(), nullptr, 10);
+        size_t end = last.empty() ? length - 1 : std::strtoull(last.c_str(), nullptr, 10);
+        if (!last.empty() && end < start)
+        {
+            return false;
+        }
+        if (start < length)
+        {
+            spans.push_back({start, std::min(end, length - 1)});
+        }
+    }
+    return count > 0;
+}
+
+/// Returns true if the If-Range validator still matches the full response
+/// @param full complete response
+/// @param request request from the client
+bool ByteRange::ifRangeMatches(const HTTPMessage &full, const HTTPMessage &request)
+{
+    std::string validator = request.getHeader("If-Range");
+    if (validator.empty())
+    {
+        return true;
+    }
+    if (validator.front() == '"')
+    {
+        // Only strong entity tags can be used with If-Range
+        return full.getHeader("ETag") == validator;
+    }
+    // The gzip copy shares the date with the uncompressed response, so a date can't tell which bytes the client holds
+    return full.getHeader("Content-Encoding") != "gzip" && full.getHeader("Last-Modified") == validator;
+}
+
+/// Returns the header text of a response with its status line replaced
+/// @param full complete response
+/// @param status new status code and reason phrase
+std::string ByteRange::withStatus(const HTTPMessage &full, const std::string &status)
+{
+    const std::string &text = full.to_string();
+    std::string version = text.substr(0, text.find(' '));
+    return version.append(" ").append(status).append(text.substr(text.find("\r\n")));
+}
+
+/// Formats the Content-Range value of a span
+/// @param span range of bytes
+/// @param length length of the full body
+std::string ByteRange::contentRange(const ByteSpan &span, size_t length)
+{
+    std::stringstream value;
+    value << "bytes " << span.first << "-" << span.second << "/" << length;
+    return value.str();
+}
+
+/// Returns the part of a complete response that the client's Range header asks for
+/// @param full complete response, from the cache or the server
+/// @param request request from the client
+HTTPMessage ByteRange::serve(const HTTPMessage &full, const HTTPMessage &request)
+{
+    std::string range = request.getHeader("Range");
+    if (range.empty() || full.to_string().find("\r\n\r\n") == std::string::npos || full.getStatusCode() != 200 ||
+        !ifRangeMatches(full, request))
+    {
+        return full;
+    }
+    std::string body = full.getBody();
+    std::vector<ByteSpan> spans;
+    if (!parse(range, body.length(), spans))
+    {
+        return full;
+    }
+    if (spans.empty())
+    {
+        HTTPMessage unsatisfiable(withStatus(full, "416 Range Not Satisfiable"));
+        unsatisfiable.setBody("");
+        unsatisfiable.setHeader("Content-Range", "bytes */" + std::to_string(body.length()));
+        return unsatisfiable;
+    }
+
+    HTTPMessage partial(withStatus(full, "206 Partial Content"));
+    partial.setHeader("Accept-Ranges", "bytes");
+    if (spans.size() == 1)
+    {
+        const ByteSpan &span = spans.front();
+        partial.setBody(body.substr(span.first, span.second - span.first + 1));
+        partial.setHeader("Content-Range", contentRange(span, body.length()));
+        return partial;
+    }
+
+    std::string content_type = full.getHeader("Content-Type");
+    std::string parts;
+    for (const ByteSpan &span : spans)
+    {
+        parts.append("\r\n--").append(BOUNDARY);
+        if (!content_type.empty())
+        {
+            parts.append("\r\nContent-Type: ").append(content_type);
+        }
+        parts.append("\r\nContent-Range: ").append(contentRange(span, body.length())).append("\r\n\r\n");
+        parts.append(body, span.first, span.second - span.first + 1);
+    }
+    parts.append("\r\n--").append(BOUNDARY).append("--\r\n");
+    partial.setBody(parts);
+    partial.setHeader("Content-Type", std::string("multipart/byteranges; boundary=") + BOUNDARY);
+    return partial;
+}
@@ -1,158 +1,941 @@
 #pragma once
 
+#include <atomic>
 #include <filesystem>
 #include <unordered_map>
 #include <deque>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <optional>
+#include <vector>
 #include <fstream>
 #include <iostream>
 #include <chrono>
 #include <ctime>
 #include <iterator>
+#include <sstream>
+#include <algorithm>
+#include "ContentEncoding.hpp"
+#include "Epoch.hpp"
 #include "HTTPMessage.hpp"
 #include "GlobalItems.hpp"
+#include "ProxyConfig.hpp"
 
 typedef std::time_t SystemTimestamp;
 
+/// Cell on disk (L3) and its state. Cells live as long as the cache and pass from key to key, so readers can use
+/// them without holding anything; owner tells whether the index entry a reader found still names the cell's key.
 struct CacheItem
 {
-    int index;
-    SystemTimestamp timestamp;
+    const int index;
+    std::atomic<uint64_t> owner{0};      // Claim of the key holding the cell, 0 while the cell is unused
+    std::atomic<SystemTimestamp> timestamp{0};
+    std::atomic<int> hits{0};
+    std::atomic<uint64_t> lookups{0};    // Requests served by the cell since it was claimed, ranks keys for warming
+    std::atomic<uint64_t> generation{0}; // Changes every time the cell is rewritten, 0 until the first write
+    std::atomic<uint64_t> last_used{0};  // Recency clock value of the last insert or lookup, 0 for unused cells
+    std::mutex write_lock;               // Taken by writers claiming or rewriting the cell, never by readers
+    std::string key;                     // Key holding the cell, guarded by write_lock
+
+    CacheItem(int index) : index(index) {}
+};
+
+/// Index entry of a key
+struct IndexEntry
+{
+    CacheItem *item;
+    uint64_t owner; // Claim the entry was published for, the entry is stale once the cell has another owner
+    // Request headers the origin varies the response on. Only set on the entry of a key whose responses are stored
+    // per variant, that entry has no cell and the variants are stored under the keys variantKey builds.
+    std::shared_ptr<const std::vector<std::string>> vary;
+};
+
+typedef std::unordered_map<std::string, IndexEntry> IndexMap;
+
+/// Part of the index. Readers look keys up in the published map inside an Epoch::Guard, without any lock or write
+/// to shared memory. Writers copy the map under write_lock, change the copy, publish it and retire the old map.
+struct alignas(64) IndexShard
+{
+    std::atomic<const IndexMap *> map{nullptr};
+    std::mutex write_lock;
+};
+
+/// Cell contents held in shared memory (L2)
+struct MemoryItem
+{
+    std::shared_ptr<const std::string> data;
+    uint64_t generation;
+    int hits;
+    std::list<std::string>::iterator recency;
+};
+
+/// Cell contents held in a hot slot (L1)
+struct HotItem
+{
+    std::string key;
+    std::shared_ptr<const std::string> data;
+    uint64_t generation;
+    int hits;
+};
+
+/// Hot slot. Its item is replaced under memory_lock and retired through Epoch, so readers copy the contents out
+/// under an Epoch::Guard without writing anything the slot shares.
+struct alignas(64) HotSlot
+{
+    std::atomic<const HotItem *> item{nullptr};
+};
+
+/// Entry found by a cache lookup, its response is only read once it is served
+struct CacheHit
+{
+    SystemTimestamp timestamp; // Time the response was stored or last confirmed by the server
+    std::string key;
+    IndexEntry entry;
+};
+
+/// Lookups a thread made that are not applied to the recency of their cells yet. Client threads are short lived,
+/// so whatever is left is applied when the thread exits.
+struct RecencyBuffer
+{
+    uint64_t cache_id = 0; // Cache the lookups were made in
+    std::vector<IndexEntry> pending;
+
+    ~RecencyBuffer();
+};
+
+/// Hit counters of each cache tier
+struct CacheStats
+{
+    std::atomic<uint64_t> hot_hits{0};
+    std::atomic<uint64_t> memory_hits{0};
+    std::atomic<uint64_t> disk_hits{0};
+    std::atomic<uint64_t> promotions{0};
+    std::atomic<uint64_t> demotions{0};
 };
 
 class CacheStorage
 {
+    friend struct RecencyBuffer;
+    
     const std::filesystem::path cache_folder_name = "cache_data";
     const std::string_view cache_file_name = "cache_cell_";
-    const int cache_size = 500;
+    const int cache_size;
+    const size_t memory_budget;
+    const int memory_promote_hits = 2;
+    const size_t hot_slot_count;
+    const size_t hot_max_object_size;
+    const int hot_promote_hits = 8;
+    const size_t index_shard_keys = 64; // Keys per shard, bounds the copy made by every index write
+    
+    std::deque<CacheItem> cells;
+    std::vector<IndexShard> index;
+    std::atomic<uint64_t> next_generation{1};
+    std::atomic<uint64_t> next_owner{1};
+    
+    //Recency of entries, each thread applies its lookups in batches so hits don't write the clock or the cells
+    const size_t recency_batch_size = 32;
+    std::atomic<uint64_t> recency_clock{1};
+    const uint64_t cache_id;
+    inline static std::atomic<uint64_t> next_cache_id{1};
+    inline static std::unordered_map<uint64_t, CacheStorage *> live_caches; // For buffers flushed at thread exit
+    inline static std::mutex live_lock;
+    
+    //L2, guarded by memory_lock, most recently used at the front
+    std::unordered_map<std::string, MemoryItem> memory;
+    std::list<std::string> memory_recency;
+    size_t memory_bytes = 0;
+    std::mutex memory_lock;
+    
+    //L1, read under an Epoch::Guard and only replaced while memory_lock is held
+    std::vector<HotSlot> hot;
     
-    std::unordered_map<std::string, CacheItem> lookup;
-    std::mutex lookup_lock;
+    CacheStats stats;
     
-    void writeCell(std::string s, int index);
-    std::string readCell(int index);
+    void writeCell(const std::string& s, int index, uint64_t generation);
+    bool readCell(int index, uint64_t generation, std::string& s);
+    IndexShard& shardFor(const std::string& key);
+    std::optional<IndexEntry> findEntry(const std::string& key);
+    std::optional<IndexEntry> findVariant(const HTTPMessage& msg, std::string& key);
+    static bool isCurrent(const IndexEntry& entry);
+    void publish(IndexShard& shard, IndexMap* changed);
+    void eraseEntry(const std::string& key, uint64_t owner);
+    void setVary(const std::string& key, const std::vector<std::string>& vary);
+    void dropItem(const IndexEntry& entry, const std::string& key);
+    CacheItem& claimCell();
+    void touchItem(const IndexEntry& entry);
+    void applyRecency(const std::vector<IndexEntry>& pending);
+    std::optional<HTTPMessage> readHot(const std::string& key, uint64_t generation);
+    std::shared_ptr<const std::string> readMemory(const std::string& key, uint64_t generation);
+    void storeMemory(const std::string& key, std::shared_ptr<const std::string> data, const CacheItem& item,
+                     uint64_t generation);
+    void storeHot(const std::string& key, std::shared_ptr<const std::string> data, uint64_t generation, int hits);
+    void evictMemory(const std::string& key);
+    void dropMemory(const std::string& key);
     SystemTimestamp getTime();
+    std::string cacheKey(const HTTPMessage& msg);
+    static std::string variantKey(const std::string& key, const std::vector<std::string>& vary,
+                                  const HTTPMessage& msg);
+    bool cacheableMethod(const HTTPMessage& msg);
+    static bool storableResponse(const HTTPMessage& response, std::vector<std::string>& vary);
     
 public:
-    CacheStorage();
+    CacheStorage(const ProxyConfig& config);
+    ~CacheStorage();
     
-    bool containsItem(HTTPMessage& msg);
-    SystemTimestamp getTimestamp(HTTPMessage& msg);
+    std::optional<CacheHit> lookupItem(HTTPMessage& msg);
+    std::optional<HTTPMessage> readItem(const CacheHit& hit);
+    bool containsItem(const HTTPMessage& msg);
     void insertItem(HTTPMessage& msg, HTTPMessage& response);
     void refreshItem(HTTPMessage& msg);
-    HTTPMessage getItem(HTTPMessage& msg);
+    std::vector<std::string> topKeys(size_t count);
+    void logStats();
 };
 
-CacheStorage::CacheStorage()
+/// Creates the cache with the sizes and budgets from the configuration
+/// @param config proxy configuration
+CacheStorage::CacheStorage(const ProxyConfig &config)
+    : cache_size(config.cache_size), memory_budget(config.memory_budget), hot_slot_count(config.hot_slot_count),
+      hot_max_object_size(config.hot_max_object_size),
+      index(std::max<size_t>(16, config.cache_size / index_shard_keys)), cache_id(next_cache_id++),
+      hot(hot_slot_count)
 {
     std::filesystem::create_directory(cache_folder_name);
-    for (int i = 1; i <= cache_size; i++) //Fill the table with garbage
+    //Cells of a previous run stay on disk, so generations continue past theirs and none of them can match a new
+    //entry. Leftovers of interrupted writes are removed.
+    uint64_t highest_generation = 0;
+    std::error_code err;
+    for (const auto &entry : std::filesystem::directory_iterator(cache_folder_name, err))
     {
-        lookup.insert
-        (
-            {
-                std::to_string(i),
-                CacheItem
-                {
-                    i,
-                    getTime()
-                }
-            }
-         );
+        if (entry.path().extension() != ".txt")
+        {
+            std::filesystem::remove(entry.path(), err);
+            continue;
+        }
+        std::ifstream ifs(entry.path(), std::ios::binary);
+        uint64_t stored_generation = 0;
+        if (ifs >> stored_generation)
+        {
+            highest_generation = std::max(highest_generation, stored_generation);
+        }
+    }
+    next_generation = highest_generation + 1;
+    for (int i = 1; i <= cache_size; i++)
+    {
+        cells.emplace_back(i);
     }
+    for (IndexShard &shard : index)
+    {
+        shard.map = new IndexMap();
+    }
+    live_lock.lock();
+    live_caches[cache_id] = this;
+    live_lock.unlock();
 }
 
-/// Replaces a cache file
+/// Destroys the cache, no other thread may be using it
+CacheStorage::~CacheStorage()
+{
+    live_lock.lock();
+    live_caches.erase(cache_id);
+    live_lock.unlock();
+    for (IndexShard &shard : index)
+    {
+        delete shard.map.load();
+    }
+    for (HotSlot &slot : hot)
+    {
+        delete slot.item.load();
+    }
+}
+
+/// Replaces a cache file. The new contents are renamed into place so readers never see a partial write.
 /// @param s file contents
 /// @param index cache index being replaced
-void CacheStorage::writeCell(std::string s, int index)
+/// @param generation generation of the index entry, stored on the first line
+void CacheStorage::writeCell(const std::string& s, int index, uint64_t generation)
 {
     using namespace std::filesystem;
     
     path p = "." / cache_folder_name / std::string(cache_file_name).append(std::to_string(index)).append(".txt");
-    std::ofstream ofs(p, std::ios::trunc); //Clear the file when it's opened
-    ofs << s;
+    path temp = p;
+    temp += "." + std::to_string(generation);
+    std::ofstream ofs(temp, std::ios::trunc | std::ios::binary);
+    ofs << generation << "\n" << s;
     ofs.close();
+    std::error_code err;
+    rename(temp, p, err);
 }
 
-std::string CacheStorage::readCell(int index)
+/// Reads a cache file
+/// @param index cache index being read
+/// @param generation generation the caller's index entry expects
+/// @param s receives the file contents
+/// @return false if the cell was rewritten for another generation
+bool CacheStorage::readCell(int index, uint64_t generation, std::string& s)
 {
     using namespace std::filesystem;
     
     path p = "." / cache_folder_name / std::string(cache_file_name).append(std::to_string(index)).append(".txt");
-    std::ifstream ifs(p);
-    string s(std::istreambuf_iterator<char>{ifs}, {});
+    std::ifstream ifs(p, std::ios::binary);
+    uint64_t stored_generation = 0;
+    if (!(ifs >> stored_generation) || stored_generation != generation || ifs.get() != '\n')
+    {
+        return false;
+    }
+    s.assign(std::istreambuf_iterator<char>{ifs}, {});
     ifs.close();
-    return s;
+    return true;
+}
+
+IndexShard& CacheStorage::shardFor(const std::string &key)
+{
+    return index[std::hash<std::string>{}(key) % index.size()];
 }
 
-bool CacheStorage::containsItem(HTTPMessage &msg)
+/// Finds the index entry of a key without taking a lock
+/// @param key cache key
+std::optional<IndexEntry> CacheStorage::findEntry(const std::string &key)
 {
-    lookup_lock.lock();
-    bool contained = lookup.count(msg.to_string());
-    lookup_lock.unlock();
-    return contained;
+    IndexShard &shard = shardFor(key);
+    Epoch::Guard guard;
+    const IndexMap &map = *shard.map.load(std::memory_order_acquire);
+    auto found = map.find(key);
+    if (found == map.end())
+    {
+        return std::nullopt;
+    }
+    return found->second;
+}
+
+/// Finds the index entry of the response a request selects. Keys stored per variant are extended by the values of
+/// the request headers the origin varies on, the lookup stays inside one guard and copies nothing shared.
+/// @param msg request from the client
+/// @param key receives the key of the selected response
+std::optional<IndexEntry> CacheStorage::findVariant(const HTTPMessage &msg, std::string &key)
+{
+    key = cacheKey(msg);
+    Epoch::Guard guard;
+    const IndexMap *map = shardFor(key).map.load(std::memory_order_acquire);
+    auto found = map->find(key);
+    if (found != map->end() && found->second.vary)
+    {
+        key = variantKey(key, *found->second.vary, msg);
+        map = shardFor(key).map.load(std::memory_order_acquire);
+        found = map->find(key);
+    }
+    if (found == map->end() || found->second.vary)
+    {
+        return std::nullopt;
+    }
+    return found->second;
 }
 
-SystemTimestamp CacheStorage::getTimestamp(HTTPMessage &msg)
+/// Returns true if the cell of an entry still belongs to the entry's key. Values read from the cell before this
+/// check belong to the key too, a claim changes the owner before it changes anything else.
+/// @param entry index entry
+bool CacheStorage::isCurrent(const IndexEntry &entry)
 {
-    lookup_lock.lock();
-    auto t = lookup.at(msg.to_string()).timestamp;
-    lookup_lock.unlock();
-    return t;
+    return entry.item && entry.item->owner.load(std::memory_order_acquire) == entry.owner;
+}
+
+/// Replaces the map of a shard, write_lock of the shard must be held
+/// @param shard shard being changed
+/// @param changed changed copy of the shard's map
+void CacheStorage::publish(IndexShard &shard, IndexMap *changed)
+{
+    const IndexMap *old = shard.map.exchange(changed);
+    Epoch::retire(old);
+}
+
+/// Removes the entry of a key if it still belongs to a claim
+/// @param key cache key
+/// @param owner claim the entry was published for
+void CacheStorage::eraseEntry(const std::string &key, uint64_t owner)
+{
+    IndexShard &shard = shardFor(key);
+    shard.write_lock.lock();
+    const IndexMap *map = shard.map.load(std::memory_order_relaxed);
+    auto found = map->find(key);
+    if (found != map->end() && found->second.owner == owner)
+    {
+        IndexMap *changed = new IndexMap(*map);
+        changed->erase(key);
+        publish(shard, changed);
+    }
+    shard.write_lock.unlock();
+}
+
+/// Makes a key store its responses per variant. A response stored for the key as a whole is dropped, and so are
+/// the variants of a different Vary, which are left to eviction.
+/// @param key cache key of the request
+/// @param vary request headers the origin varies on
+void CacheStorage::setVary(const std::string &key, const std::vector<std::string> &vary)
+{
+    IndexShard &shard = shardFor(key);
+    shard.write_lock.lock();
+    const IndexMap *map = shard.map.load(std::memory_order_relaxed);
+    auto found = map->find(key);
+    if (found != map->end() && found->second.vary && *found->second.vary == vary)
+    {
+        shard.write_lock.unlock();
+        return;
+    }
+    std::optional<IndexEntry> replaced;
+    if (found != map->end() && !found->second.vary)
+    {
+        replaced = found->second;
+    }
+    IndexMap *changed = new IndexMap(*map);
+    (*changed)[key] = IndexEntry{nullptr, 0, std::make_shared<const std::vector<std::string>>(vary)};
+    publish(shard, changed);
+    shard.write_lock.unlock();
+    if (replaced)
+    {
+        dropItem(*replaced, key); //Cells are locked before shards, so the cell is released after the shard
+    }
+}
+
+/// Releases the cell of an entry so it is the next to be claimed, unless the cell was claimed for another key
+/// @param entry index entry of the key
+/// @param key cache key
+void CacheStorage::dropItem(const IndexEntry &entry, const std::string &key)
+{
+    CacheItem &cell = *entry.item;
+    cell.write_lock.lock();
+    if (isCurrent(entry))
+    {
+        eraseEntry(key, entry.owner);
+        evictMemory(key);
+        cell.key.clear();
+        cell.owner.store(0, std::memory_order_release);
+        cell.generation = 0;
+        cell.hits = 0;
+        cell.lookups = 0;
+        cell.last_used = 0;
+    }
+    cell.write_lock.unlock();
+}
+
+/// Records a lookup of an entry. Every thread collects its lookups and applies them together with one step of the
+/// clock, so lookups don't write memory shared with other threads.
+/// @param entry entry that was looked up
+void CacheStorage::touchItem(const IndexEntry &entry)
+{
+    thread_local RecencyBuffer buffer;
+    if (buffer.cache_id != cache_id)
+    {
+        buffer.pending.clear(); //Made in a cache that may be gone
+        buffer.cache_id = cache_id;
+    }
+    buffer.pending.push_back(entry);
+    if (buffer.pending.size() >= recency_batch_size)
+    {
+        applyRecency(buffer.pending);
+        buffer.pending.clear();
+    }
+}
+
+/// Stamps the cells of a batch of lookups with consecutive clock values and counts the lookups
+/// @param pending lookups to apply, entries whose cell was claimed again since are skipped
+void CacheStorage::applyRecency(const std::vector<IndexEntry> &pending)
+{
+    uint64_t tick = recency_clock.fetch_add(pending.size());
+    for (const IndexEntry &entry : pending)
+    {
+        if (isCurrent(entry))
+        {
+            entry.item->last_used.store(tick, std::memory_order_relaxed);
+            entry.item->lookups.fetch_add(1, std::memory_order_relaxed);
+        }
+        tick++;
+    }
+}
+
+/// Applies the lookups left in a thread's buffer, if their cache still exists
+RecencyBuffer::~RecencyBuffer()
+{
+    CacheStorage::live_lock.lock();
+    auto cache = CacheStorage::live_caches.find(cache_id);
+    if (cache != CacheStorage::live_caches.end())
+    {
+        cache->second->applyRecency(pending);
+    }
+    CacheStorage::live_lock.unlock();
+}
+
+/// Takes the least recently used cell for a new key and removes the key it held from the index.
+/// Cells that were never written have a last use of 0, so they go before any key in use.
+/// @return the cell with its write_lock held
+CacheItem& CacheStorage::claimCell()
+{
+    while (true)
+    {
+        CacheItem *lowest = nullptr;
+        uint64_t lowest_used = 0;
+        for (CacheItem &cell : cells)
+        {
+            uint64_t used = cell.last_used.load(std::memory_order_relaxed);
+            if (!lowest || used < lowest_used)
+            {
+                lowest = &cell;
+                lowest_used = used;
+            }
+        }
+
+        //Another insert may have taken the same cell since the scan, or a lookup may have used it, so scan again
+        lowest->write_lock.lock();
+        if (lowest->last_used.load(std::memory_order_relaxed) != lowest_used)
+        {
+            lowest->write_lock.unlock();
+            continue;
+        }
+        lowest->last_used = recency_clock++;
+        if (!lowest->key.empty())
+        {
+            eraseEntry(lowest->key, lowest->owner);
+            evictMemory(lowest->key);
+            lowest->key.clear();
+        }
+        lowest->owner.store(next_owner++, std::memory_order_release);
+        lowest->generation = 0;
+        lowest->hits = 0;
+        lowest->lookups = 0;
+        return *lowest;
+    }
 }
 
 void CacheStorage::insertItem(HTTPMessage &msg, HTTPMessage& response)
 {
-    lookup_lock.lock();
+    if (response.isEmpty() || !cacheableMethod(msg))
+    {
+        return;
+    }
+    std::string encoding = response.getHeader("Content-Encoding");
+    if (!encoding.empty() && encoding != "identity" && encoding != "gzip")
+    {
+        return; //Only encodings that can be negotiated for any client are kept
+    }
+    if (response.to_string().length() >= 12 && (response.getStatusCode() == 304 || response.getStatusCode() == 206))
+    {
+        return; //Conditional and partial answers can't stand in for the full response
+    }
+    std::string key;
+    std::vector<std::string> vary;
+    if (!storableResponse(response, vary))
+    {
+        //The origin no longer lets the response be shared, so the stored copy must not be served either
+        std::optional<IndexEntry> stored = findVariant(msg, key);
+        if (stored)
+        {
+            dropItem(*stored, key);
+        }
+        return;
+    }
+    key = cacheKey(msg);
+    if (!vary.empty())
+    {
+        setVary(key, vary);
+        key = variantKey(key, vary, msg);
+    }
+    std::optional<IndexEntry> entry = findEntry(key); //A key that stopped varying replaces its Vary entry below
+    CacheItem *item = nullptr;
+    if (entry && isCurrent(*entry))
+    {
+        item = entry->item;
+        item->write_lock.lock();
+    }
+    else
+    {
+        CacheItem &cell = claimCell();
+        IndexShard &shard = shardFor(key);
+        shard.write_lock.lock();
+        const IndexMap *map = shard.map.load(std::memory_order_relaxed);
+        auto found = map->find(key);
+        if (found != map->end() && isCurrent(found->second)) //Inserted by another thread in the meantime
+        {
+            entry = found->second;
+            cell.owner = 0;
+            cell.last_used = 0;
+            shard.write_lock.unlock();
+            cell.write_lock.unlock();
+            item = entry->item;
+            item->write_lock.lock();
+        }
+        else
+        {
+            entry = IndexEntry{&cell, cell.owner};
+            cell.key = key;
+            IndexMap *changed = new IndexMap(*map);
+            (*changed)[key] = *entry;
+            publish(shard, changed);
+            shard.write_lock.unlock();
+            item = &cell;
+        }
+    }
+    if (!isCurrent(*entry)) //Evicted while waiting for the cell, the response is simply not kept
+    {
+        item->write_lock.unlock();
+        return;
+    }
     
-    std::string key = msg.to_string();
-    if (lookup.find(key) != lookup.end()) //If message is in the cache
+    //The stored copy is replaced either way, the server only answers with a full response when it changed.
+    //Writes to a cell are serialized by its write_lock, and the generation is published only once the file under it
+    //is in place, so the published generation always names the file on disk. Readers of the old copy miss from then
+    //on: the file no longer matches their generation and the memory tiers are evicted below.
+    uint64_t generation = next_generation++;
+    if (ContentEncoding::isCompressible(response))
     {
-        lookup[key].timestamp = getTime();
+        writeCell(ContentEncoding::compress(response).to_string(), item->index, generation);
     }
     else
     {
-        std::pair<std::string, CacheItem> lowest;
-        for (auto item : lookup)
+        writeCell(response.to_string(), item->index, generation);
+    }
+    item->generation.store(generation, std::memory_order_release);
+    item->timestamp = getTime();
+    item->last_used = recency_clock++;
+    item->hits = 0;
+    evictMemory(key);
+    item->write_lock.unlock();
+}
+
+/// Marks a cached response as confirmed by the server
+/// @param msg request from the client
+void CacheStorage::refreshItem(HTTPMessage &msg)
+{
+    std::string key;
+    std::optional<IndexEntry> entry = findVariant(msg, key);
+    if (entry && isCurrent(*entry))
+    {
+        entry->item->timestamp = getTime();
+    }
+}
+
+/// Looks a request up in the index only, the response is read by readItem when it is served.
+/// Nothing shared is locked or written, the lookup is recorded in the thread's recency buffer.
+/// @param msg request from the client
+std::optional<CacheHit> CacheStorage::lookupItem(HTTPMessage &msg)
+{
+    if (!cacheableMethod(msg))
+    {
+        return std::nullopt;
+    }
+    std::string key;
+    std::optional<IndexEntry> entry = findVariant(msg, key);
+    if (!entry)
+    {
+        return std::nullopt;
+    }
+    uint64_t generation = entry->item->generation.load(std::memory_order_acquire);
+    SystemTimestamp timestamp = entry->item->timestamp;
+    if (generation == 0 || !isCurrent(*entry))
+    {
+        return std::nullopt;
+    }
+    touchItem(*entry);
+    return CacheHit{timestamp, std::move(key), *entry};
+}
+
+/// Reads a looked up response from the fastest tier holding it, in the encoding it is stored in.
+/// A response stored for the key since the lookup is read instead, it is at least as fresh.
+/// @param hit entry returned by lookupItem
+/// @return nothing if the key was evicted since the lookup
+std::optional<HTTPMessage> CacheStorage::readItem(const CacheHit &hit)
+{
+    CacheItem &item = *hit.entry.item;
+    uint64_t generation = item.generation.load(std::memory_order_acquire);
+    if (generation == 0 || !isCurrent(hit.entry))
+    {
+        return std::nullopt;
+    }
+    std::optional<HTTPMessage> hot_copy = readHot(hit.key, generation);
+    if (hot_copy)
+    {
+        stats.hot_hits++;
+        return hot_copy;
+    }
+    std::shared_ptr<const std::string> data = readMemory(hit.key, generation);
+    if (data)
+    {
+        stats.memory_hits++;
+        return HTTPMessage(*data);
+    }
+    
+    std::string cell;
+    if (!readCell(item.index, generation, cell))
+    {
+        return std::nullopt; //Evicted or rewritten while reading, treat it as a miss
+    }
+    data = std::make_shared<const std::string>(std::move(cell));
+    if (++item.hits >= memory_promote_hits)
+    {
+        storeMemory(hit.key, data, item, generation);
+    }
+    stats.disk_hits++;
+    return HTTPMessage(*data);
+}
+
+/// Returns true if a response is stored for a request, without reading it or counting a lookup
+/// @param msg request to check
+bool CacheStorage::containsItem(const HTTPMessage &msg)
+{
+    std::string key;
+    std::optional<IndexEntry> entry = findVariant(msg, key);
+    return entry && entry->item->generation.load(std::memory_order_acquire) != 0 && isCurrent(*entry);
+}
+
+/// Returns the keys of the most requested stored responses, leaving out the ones that belong to a single user
+/// @param count maximum number of keys
+std::vector<std::string> CacheStorage::topKeys(size_t count)
+{
+    std::vector<std::pair<uint64_t, std::string>> ranked;
+    for (IndexShard &shard : index)
+    {
+        Epoch::Guard guard;
+        for (auto &entry : *shard.map.load(std::memory_order_acquire))
         {
-            if (lowest.first.empty())
-                lowest = item;
-            if (item.second.timestamp < lowest.second.timestamp)
+            const std::string &key = entry.first;
+            if (entry.second.vary)
+            {
+                continue; //Its variants have entries of their own
+            }
+            uint64_t lookups = entry.second.item->lookups;
+            if (entry.second.item->generation == 0 || !isCurrent(entry.second) || key.rfind("GET ", 0) != 0 ||
+                key.find("\r\nCookie: ") != std::string::npos || key.find("\r\nAuthorization: ") != std::string::npos)
             {
-                lowest = item;
+                continue;
             }
+            ranked.push_back({lookups, key});
         }
-        lookup.erase(lowest.first);
-        lowest.second.timestamp = getTime();
-        lowest.first = msg.to_string();
-        lookup.insert(lowest);
-        writeCell(response.to_string(), lowest.second.index);
     }
-    
-    lookup_lock.unlock();
+    std::sort(ranked.begin(), ranked.end(), [](auto &a, auto &b) { return a.first > b.first; });
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < ranked.size() && i < count; i++)
+    {
+        keys.push_back(ranked[i].second);
+    }
+    return keys;
 }
 
-void CacheStorage::refreshItem(HTTPMessage &msg)
+/// Looks a key up in the hot slots without locking or writing the slot, not even a reference count
+/// @param key cache key
+/// @param generation generation of the index entry
+std::optional<HTTPMessage> CacheStorage::readHot(const std::string &key, uint64_t generation)
+{
+    HotSlot &slot = hot[std::hash<std::string>{}(key) % hot.size()];
+    Epoch::Guard guard;
+    const HotItem *item = slot.item.load(std::memory_order_acquire);
+    if (item && item->key == key && item->generation == generation)
+    {
+        return HTTPMessage(*item->data); //Copied while the guard keeps the item alive
+    }
+    return std::nullopt;
+}
+
+/// Looks a key up in memory and promotes it to a hot slot once it is accessed often enough
+/// @param key cache key
+/// @param generation generation of the index entry
+std::shared_ptr<const std::string> CacheStorage::readMemory(const std::string &key, uint64_t generation)
+{
+    memory_lock.lock();
+    auto found = memory.find(key);
+    if (found == memory.end() || found->second.generation != generation)
+    {
+        memory_lock.unlock();
+        return nullptr;
+    }
+    MemoryItem &item = found->second;
+    item.hits++;
+    memory_recency.splice(memory_recency.begin(), memory_recency, item.recency);
+    std::shared_ptr<const std::string> data = item.data;
+    if (item.hits >= hot_promote_hits && data->length() <= hot_max_object_size)
+    {
+        storeHot(key, data, generation, item.hits);
+    }
+    memory_lock.unlock();
+    return data;
+}
+
+/// Adds cell contents to memory, demoting the least recently used entries past the budget
+/// @param key cache key
+/// @param data cell contents
+/// @param item index entry the contents were read for
+/// @param generation generation the contents were read at
+void CacheStorage::storeMemory(const std::string &key, std::shared_ptr<const std::string> data, const CacheItem &item,
+                               uint64_t generation)
+{
+    if (data->length() > memory_budget)
+    {
+        return;
+    }
+    memory_lock.lock();
+    //Inserts bump the generation before evicting under memory_lock, so a stale copy is never stored
+    if (memory.count(key) == 0 && item.generation == generation)
+    {
+        memory_recency.push_front(key);
+        memory[key] = MemoryItem{data, generation, item.hits, memory_recency.begin()};
+        memory_bytes += data->length();
+        stats.promotions++;
+    }
+    while (memory_bytes > memory_budget)
+    {
+        dropMemory(memory_recency.back()); //Hot slots keep their copy
+    }
+    memory_lock.unlock();
+}
+
+/// Places cell contents in their hot slot if they are accessed more than the current occupant
+/// @param key cache key
+/// @param data cell contents
+/// @param generation generation of the index entry
+/// @param hits accesses seen so far
+void CacheStorage::storeHot(const std::string &key, std::shared_ptr<const std::string> data, uint64_t generation,
+                            int hits)
+{
+    HotSlot &slot = hot[std::hash<std::string>{}(key) % hot.size()];
+    const HotItem *current = slot.item.load(std::memory_order_relaxed); //Only replaced under memory_lock, which is held
+    if (current && ((current->key == key && current->generation == generation) || current->hits > hits))
+    {
+        return;
+    }
+    if (current)
+    {
+        stats.demotions++;
+    }
+    Epoch::retire(slot.item.exchange(new HotItem{key, data, generation, hits}, std::memory_order_acq_rel));
+    stats.promotions++;
+}
+
+/// Drops a key from the hot slots and memory, leaving the copy on disk
+/// @param key cache key
+void CacheStorage::evictMemory(const std::string &key)
+{
+    memory_lock.lock();
+    HotSlot &slot = hot[std::hash<std::string>{}(key) % hot.size()];
+    const HotItem *current = slot.item.load(std::memory_order_relaxed);
+    if (current && current->key == key)
+    {
+        Epoch::retire(slot.item.exchange(nullptr, std::memory_order_acq_rel));
+    }
+    dropMemory(key);
+    memory_lock.unlock();
+}
+
+/// Removes a key from memory, memory_lock must be held
+/// @param key cache key
+void CacheStorage::dropMemory(const std::string &key)
+{
+    auto found = memory.find(key);
+    if (found != memory.end())
+    {
+        memory_bytes -= found->second.data->length();
+        memory_recency.erase(found->second.recency);
+        memory.erase(found);
+        stats.demotions++;
+    }
+}
+
+/// Prints the hit counters and sizes of each tier
+void CacheStorage::logStats()
 {
-    lookup_lock.lock();
-    std::string key = msg.to_string();
-    if (lookup.find(key) != lookup.end()) //If message is in the cache
+    memory_lock.lock();
+    size_t memory_count = memory.size();
+    size_t bytes = memory_bytes;
+    memory_lock.unlock();
+    GFD::threadedCout("Cache hits L1: ", stats.hot_hits.load(), " L2: ", stats.memory_hits.load(),
+                      " L3: ", stats.disk_hits.load(), ", L2 holds ", memory_count, " items in ", bytes, " of ",
+                      memory_budget, " bytes, promotions: ", stats.promotions.load(),
+                      " demotions: ", stats.demotions.load());
+}
+
+/// Builds the lookup key of a request from the parts that select the stored response.
+/// Range, conditional and encoding headers are left out since those are served from the full cached copy.
+/// @param msg request from the client
+std::string CacheStorage::cacheKey(const HTTPMessage &msg)
+{
+    const std::string &text = msg.to_string();
+    std::string key = text.substr(0, text.find("\r\n"));
+    key.append("\r\nHost: ").append(msg.getHeader("Host"));
+    for (const char *header : {"Cookie", "Authorization"})
     {
-        lookup[key].timestamp = getTime();
+        std::string value = msg.getHeader(header);
+        if (!value.empty())
+        {
+            key.append("\r\n").append(header).append(": ").append(value);
+        }
     }
-    lookup_lock.unlock();
+    return key;
+}
+
+/// Returns true if the response to a request may be stored. The key leaves the body out, so only methods whose
+/// response depends on the request line and headers alone are cached.
+/// @param msg request from the client
+bool CacheStorage::cacheableMethod(const HTTPMessage &msg)
+{
+    std::string method = msg.getMethod();
+    return method == "GET" || method == "HEAD";
 }
 
-HTTPMessage CacheStorage::getItem(HTTPMessage &msg)
+/// Extends a cache key by the request headers the origin varies on
+/// @param key cache key of the request
+/// @param vary lower case names of the request headers
+/// @param msg request from the client
+std::string CacheStorage::variantKey(const std::string &key, const std::vector<std::string> &vary,
+                                     const HTTPMessage &msg)
 {
-    lookup_lock.lock();
-    auto item = lookup.at(msg.to_string());
-    int index = item.index;
-    item.timestamp = getTime();
-    std::string data = readCell(index);
-    lookup_lock.unlock();
-    return HTTPMessage(data);
+    std::string variant = key;
+    for (const std::string &header : vary)
+    {
+        variant.append("\r\n").append(header).append(": ").append(msg.getHeader(header));
+    }
+    return variant;
+}
+
+/// Returns true if a shared cache may store a response, and collects the request headers it varies on.
+/// Accept-Encoding is left out of them, every client is served from the one stored copy by negotiation.
+/// @param response response from the server
+/// @param vary receives the lower case header names, sorted
+bool CacheStorage::storableResponse(const HTTPMessage &response, std::vector<std::string> &vary)
+{
+    auto tokens = [](std::string value) {
+        std::transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return std::tolower(c); });
+        std::vector<std::string> names;
+        std::stringstream list(value);
+        std::string token;
+        while (std::getline(list, token, ','))
+        {
+            size_t start = token.find_first_not_of(" \t");
+            if (start != std::string::npos)
+            {
+                token = token.substr(start, token.find_first_of(" \t=", start) - start);
+                names.push_back(token);
+            }
+        }
+        return names;
+    };
+    for (const std::string &directive : tokens(response.getHeader("Cache-Control")))
+    {
+        if (directive == "no-store" || directive == "private")
+        {
+            return false;
+        }
+    }
+    for (const std::string &header : tokens(response.getHeader("Vary")))
+    {
+        if (header == "*")
+        {
+            return false; //Varies on more than the request, no stored copy can be selected
+        }
+        if (header != "accept-encoding")
+        {
+            vary.push_back(header);
+        }
+    }
+    std::sort(vary.begin(), vary.end());
+    vary.erase(std::unique(vary.begin(), vary.end()), vary.end());
+    return true;
 }
 
 SystemTimestamp CacheStorage::getTime()
@@ -0,0 +1,519 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "AdmissionControl.hpp"
+#include "CacheStorage.hpp"
+#include "ContentEncoding.hpp"
+#include "GlobalItems.hpp"
+#include "HTTPMessage.hpp"
+#include "ProxyConfig.hpp"
+#include "ServerSocket.hpp"
+#include "TimerWheel.hpp"
+
+/// Request the warmer fetches into the cache
+struct WarmRequest
+{
+    std::string target; // Request target, in origin or absolute form
+    std::string host;   // Host header value
+};
+
+/// HTML page waiting to be searched for links
+struct PendingPage
+{
+    WarmRequest page;
+    std::string body; // Start of the body as received, still chunked if chunked is set and gzip encoded if gzip is set
+    bool gzip;
+    bool chunked;
+};
+
+/// Counters of the warmer since startup
+struct WarmerStats
+{
+    std::atomic<uint64_t> warmed{0};
+    std::atomic<uint64_t> prefetched{0};
+    std::atomic<uint64_t> skipped{0}; // Already cached or dropped from a full queue
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> rejected{0}; // Turned away by admission control
+};
+
+/// Fills the cache ahead of clients: replays a list of requests and the most requested keys of the previous run
+/// at startup, and prefetches the assets linked from HTML pages while the proxy is quiet
+class CacheWarmer
+{
+    static constexpr size_t MAX_SCAN_SIZE = 512 * 1024; // HTML past this is not searched for links
+    static constexpr size_t MAX_SEEN = 4096;            // Links remembered to avoid queueing them twice
+    static constexpr size_t MAX_PENDING_PAGES = 16;     // Pages waiting to be searched, more are dropped
+
+    CacheStorage &cache;
+    TimerWheel &timers;
+    AdmissionControl &admission;
+    std::atomic<int> live_clients{0};
+
+    // Pages waiting to be searched and links waiting to be prefetched, guarded by prefetch_lock
+    std::deque<PendingPage> scan_queue;
+    std::deque<WarmRequest> prefetch_queue;
+    std::unordered_set<std::string> prefetch_seen;
+    std::mutex prefetch_lock;
+
+    WarmerStats stats;
+
+    static bool parseLine(const std::string &line, WarmRequest &request);
+    static std::vector<WarmRequest> readList(const std::string &path);
+    static std::vector<std::string> findLinks(const std::string &html);
+    static bool resolveLink(const WarmRequest &page, const std::string &link, WarmRequest &resolved);
+    bool fetch(const WarmRequest &request);
+    void scanPage(const PendingPage &pending);
+    void runPrefetch();
+
+  public:
+    CacheWarmer(CacheStorage &cache, TimerWheel &timers, AdmissionControl &admission)
+        : cache(cache), timers(timers), admission(admission){};
+    void start(const ProxyConfig &config);
+    void clientOpened();
+    void clientClosed();
+    void scanLinks(const HTTPMessage &request, const HTTPMessage &response);
+    void saveKeys(const ProxyConfig &config);
+    void logStats();
+};
+
+/// Parses a line of a warm list: a request target, then the Host value if the target is not an absolute http URL
+/// @param line line of the list, blank lines and lines starting with '#' are skipped
+/// @param request receives the parsed request
+bool CacheWarmer::parseLine(const std::string &line, WarmRequest &request)
+{
+    std::stringstream fields(line);
+    request = WarmRequest();
+    fields >> request.target >> request.host;
+    if (request.target.empty() || request.target.front() == '#')
+    {
+        return false;
+    }
+    if (request.host.empty())
+    {
+        const std::string scheme = "http://";
+        if (request.target.rfind(scheme, 0) != 0)
+        {
+            GFD::threadedCout("Warm list entry has no host: ", line);
+            return false;
+        }
+        size_t path = request.target.find('/', scheme.length());
+        request.host = request.target.substr(scheme.length(), path - scheme.length());
+    }
+    return !request.host.empty();
+}
+
+/// Reads every request of a warm list
+/// @param path file to read, a missing file is an empty list
+std::vector<WarmRequest> CacheWarmer::readList(const std::string &path)
+{
+    std::vector<WarmRequest> requests;
+    std::ifstream file(path);
+    std::string line;
+    WarmRequest request;
+    while (std::getline(file, line))
+    {
+        if (parseLine(line, request))
+        {
+            requests.push_back(request);
+        }
+    }
+    return requests;
+}
+
+/// Starts replaying the configured lists in the background, and the prefetcher if it is enabled
+/// @param config configuration at startup
+void CacheWarmer::start(const ProxyConfig &config)
+{
+    std::vector<WarmRequest> requests;
+    for (const std::string &path : {config.warm_list, config.warm_keys_file})
+    {
+        if (!path.empty())
+        {
+            std::vector<WarmRequest> list = readList(path);
+            requests.insert(requests.end(), list.begin(), list.end());
+        }
+    }
+    if (!requests.empty())
+    {
+        GFD::threadedCout("Warming the cache with ", requests.size(), " requests");
+        // Workers take the next request from a shared position until the list runs out
+        auto list = std::make_shared<std::vector<WarmRequest>>(std::move(requests));
+        auto next = std::make_shared<std::atomic<size_t>>(0);
+        for (int i = 0; i < config.warm_concurrency; i++)
+        {
+            std::thread worker([this, list, next] {
+                for (size_t index = (*next)++; index < list->size(); index = (*next)++)
+                {
+                    if (fetch((*list)[index]))
+                    {
+                        stats.warmed++;
+                    }
+                }
+            });
+            worker.detach();
+        }
+    }
+    std::thread prefetcher(&CacheWarmer::runPrefetch, this);
+    prefetcher.detach();
+}
+
+/// Fetches a request from its server and stores the response unless it is already cached. The fetch goes through
+/// the same admission as client requests, so warming never adds to an origin that is busy or failing.
+/// @param warm request to fetch
+/// @return true if a response was stored
+bool CacheWarmer::fetch(const WarmRequest &warm)
+{
+    std::shared_ptr<const ProxyConfig> config = Config::get();
+    HTTPMessage request("GET " + warm.target + " HTTP/1.1\r\nHost: " + warm.host + "\r\n\r\n");
+    if (cache.containsItem(request))
+    {
+        stats.skipped++;
+        return false;
+    }
+    // Asking for gzip keeps the transfer small, stored responses are decoded again for clients that need it
+    HTTPMessage upstream(request);
+    upstream.setHeader("Accept-Encoding", "gzip");
+    std::string origin = request.hostName() + ":" + std::to_string(request.hostPort(config->upstream_port));
+    bool probe;
+    if (admission.admitOrigin(origin, *config, probe) != Admission::Admitted)
+    {
+        stats.rejected++;
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    ServerSocket server(config);
+    PhaseTimer server_timer(timers, config);
+    bool connected = server.connectTo(request.hostPort(config->upstream_port), request.hostName());
+    SocketResult result{HTTPMessage(""), 0, 0};
+    if (connected)
+    {
+        server_timer.watch(server.getFD());
+        server.send(upstream);
+        result = server.receive(&server_timer);
+    }
+    admission.release(origin, probe,
+                      !connected || result.message.isEmpty() || result.message.getStatusCode() >= 500,
+                      std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start),
+                      *config);
+    if (!connected || server_timer.expired() || result.message.isEmpty() || result.message.getStatusCode() != 200)
+    {
+        stats.failed++;
+        return false;
+    }
+    cache.insertItem(request, result.message);
+    scanLinks(request, result.message);
+    return true;
+}
+
+/// Searches queued pages for links and prefetches queued links one at a time at the configured rate, waiting while
+/// clients are being served
+void CacheWarmer::runPrefetch()
+{
+    while (true)
+    {
+        std::shared_ptr<const ProxyConfig> config = Config::get();
+        std::this_thread::sleep_for(std::chrono::microseconds(std::max(1, 1000000 / config->prefetch_rate)));
+        if (live_clients > config->prefetch_max_live_clients)
+        {
+            continue;
+        }
+        std::deque<PendingPage> pages;
+        prefetch_lock.lock();
+        pages.swap(scan_queue);
+        prefetch_lock.unlock();
+        for (const PendingPage &page : pages)
+        {
+            scanPage(page);
+        }
+        prefetch_lock.lock();
+        if (prefetch_queue.empty())
+        {
+            prefetch_lock.unlock();
+            continue;
+        }
+        WarmRequest request = prefetch_queue.front();
+        prefetch_queue.pop_front();
+        prefetch_lock.unlock();
+        if (fetch(request))
+        {
+            stats.prefetched++;
+        }
+    }
+}
+
+/// Counts a client being served, prefetching pauses while there are too many
+void CacheWarmer::clientOpened()
+{
+    live_clients++;
+}
+
+void CacheWarmer::clientClosed()
+{
+    live_clients--;
+}
+
+/// Returns the values of the src and href attributes in a page
+/// @param html page to search
+std::vector<std::string> CacheWarmer::findLinks(const std::string &html)
+{
+    std::string lower(html);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+    std::vector<std::string> links;
+    for (const std::string attribute : {"src=", "href="})
+    {
+        for (size_t pos = lower.find(attribute); pos != std::string::npos; pos = lower.find(attribute, pos))
+        {
+            // The attribute name must stand on its own, not end another name such as data-src
+            bool separate = pos > 0 && std::isspace((unsigned char)lower[pos - 1]);
+            pos += attribute.length();
+            if (!separate || pos >= html.length())
+            {
+                continue;
+            }
+            size_t end;
+            if (html[pos] == '"' || html[pos] == '\'')
+            {
+                end = html.find(html[pos], pos + 1);
+                pos++;
+            }
+            else
+            {
+                end = html.find_first_of(" \t\r\n>", pos);
+            }
+            if (end == std::string::npos)
+            {
+                break;
+            }
+            links.push_back(html.substr(pos, end - pos));
+            pos = end;
+        }
+    }
+    return links;
+}
+
+/// Resolves a link on a page to a request for the same origin, if it points at a stylesheet, script or image
+/// @param page request the page was fetched with
+/// @param link value of a src or href attribute
+/// @param resolved receives the request for the link, in the same form as the page request
+bool CacheWarmer::resolveLink(const WarmRequest &page, const std::string &link, WarmRequest &resolved)
+{
+    const std::string scheme = "http://";
+    std::string origin = page.target.rfind(scheme, 0) == 0 ? scheme + page.host : "";
+    std::string path = link.substr(0, link.find('#'));
+    if (path.rfind("//", 0) == 0)
+    {
+        path = "http:" + path;
+    }
+    if (path.rfind(scheme, 0) == 0)
+    {
+        size_t slash = path.find('/', scheme.length());
+        if (path.substr(scheme.length(), slash - scheme.length()) != page.host)
+        {
+            return false;
+        }
+        path = slash == std::string::npos ? "/" : path.substr(slash);
+    }
+    else if (path.find(':') < path.find_first_of("/?"))
+    {
+        return false; // Another scheme such as https, data or javascript
+    }
+    else if (path.empty() || path.front() != '/')
+    {
+        std::string base = page.target.substr(origin.length());
+        path = base.substr(0, base.find('?')).substr(0, base.rfind('/', base.find('?')) + 1) + path;
+    }
+
+    // Remove dot segments
+    std::string query;
+    if (path.find('?') != std::string::npos)
+    {
+        query = path.substr(path.find('?'));
+        path = path.substr(0, path.find('?'));
+    }
+    std::vector<std::string> segments;
+    std::stringstream parts(path);
+    std::string segment;
+    while (std::getline(parts, segment, '/'))
+    {
+        if (segment == "..")
+        {
+            if (!segments.empty())
+            {
+                segments.pop_back();
+            }
+        }
+        else if (!segment.empty() && segment != ".")
+        {
+            segments.push_back(segment);
+        }
+    }
+    path.clear();
+    for (const std::string &part : segments)
+    {
+        path += "/" + part;
+    }
+
+    static const char *extensions[] = {".css", ".js", ".mjs", ".png", ".jpg", ".jpeg",
+                                       ".gif", ".svg", ".webp", ".avif", ".ico"};
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+    {
+        return false;
+    }
+    std::string extension = path.substr(dot);
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    if (std::find(std::begin(extensions), std::end(extensions), extension) == std::end(extensions))
+    {
+        return false;
+    }
+    resolved.target = origin + path + query;
+    resolved.host = page.host;
+    return true;
+}
+
+/// Queues an HTML response to be searched for links by the prefetch thread. Only the first MAX_SCAN_SIZE bytes of the
+/// body are copied here as they were received, removing the chunked coding, decoding and searching them is left to
+/// the prefetch thread.
+/// @param request request the response answers
+/// @param response response from the server
+void CacheWarmer::scanLinks(const HTTPMessage &request, const HTTPMessage &response)
+{
+    std::shared_ptr<const ProxyConfig> config = Config::get();
+    std::string content_type = response.getHeader("Content-Type");
+    std::transform(content_type.begin(), content_type.end(), content_type.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    if (!config->prefetch_links || request.getMethod() != "GET" || response.getStatusCode() != 200 ||
+        content_type.find("text/html") == std::string::npos || !request.getHeader("Cookie").empty() ||
+        !request.getHeader("Authorization").empty())
+    {
+        return;
+    }
+    const std::string &text = response.to_string();
+    size_t body_start = text.find("\r\n\r\n");
+    if (body_start == std::string::npos)
+    {
+        return;
+    }
+    PendingPage pending{{request.getTarget(), request.getHeader("Host")}, text.substr(body_start + 4, MAX_SCAN_SIZE),
+                        response.getHeader("Content-Encoding") == "gzip",
+                        response.getHeader("Transfer-Encoding").find("chunked") != std::string::npos};
+    prefetch_lock.lock();
+    if (scan_queue.size() >= MAX_PENDING_PAGES)
+    {
+        prefetch_lock.unlock();
+        stats.skipped++;
+        return;
+    }
+    scan_queue.push_back(std::move(pending));
+    prefetch_lock.unlock();
+}
+
+/// Queues the same origin assets linked from a page for prefetching
+/// @param pending page queued by scanLinks
+void CacheWarmer::scanPage(const PendingPage &pending)
+{
+    std::shared_ptr<const ProxyConfig> config = Config::get();
+    std::string html = pending.chunked ? HTTPMessage::decodeChunked(pending.body) : pending.body;
+    if (pending.gzip)
+    {
+        std::string decoded;
+        ContentEncoding::gunzip(html, [&decoded](const char *data, size_t size) {
+            if (decoded.length() < MAX_SCAN_SIZE)
+            {
+                decoded.append(data, size);
+            }
+        });
+        html = decoded;
+    }
+    html.resize(std::min(html.length(), MAX_SCAN_SIZE));
+
+    std::vector<WarmRequest> found;
+    for (const std::string &link : findLinks(html))
+    {
+        WarmRequest resolved;
+        if (resolveLink(pending.page, link, resolved))
+        {
+            found.push_back(resolved);
+        }
+    }
+    prefetch_lock.lock();
+    for (const WarmRequest &link : found)
+    {
+        std::string key = link.host + " " + link.target;
+        if (prefetch_seen.count(key))
+        {
+            continue;
+        }
+        if (prefetch_queue.size() >= config->prefetch_queue_size)
+        {
+            stats.skipped++;
+            continue;
+        }
+        if (prefetch_seen.size() >= MAX_SEEN)
+        {
+            prefetch_seen.clear();
+        }
+        prefetch_seen.insert(key);
+        prefetch_queue.push_back(link);
+    }
+    prefetch_lock.unlock();
+}
+
+/// Saves the most requested keys as a warm list for the next start
+/// @param config configuration naming the file and the number of keys
+void CacheWarmer::saveKeys(const ProxyConfig &config)
+{
+    if (config.warm_keys_file.empty())
+    {
+        return;
+    }
+    std::string temp = config.warm_keys_file + ".tmp";
+    std::ofstream file(temp, std::ios::trunc);
+    size_t count = 0;
+    for (const std::string &key : cache.topKeys(config.warm_top_keys))
+    {
+        // Keys start with the request line and Host header, see CacheStorage::cacheKey
+        HTTPMessage request(key + "\r\n\r\n");
+        std::string target = request.getTarget();
+        std::string host = request.getHeader("Host");
+        if (!target.empty() && !host.empty())
+        {
+            file << target << " " << host << "\n";
+            count++;
+        }
+    }
+    file.close();
+    if (!file || std::rename(temp.c_str(), config.warm_keys_file.c_str()) != 0)
+    {
+        GFD::threadedCout("Failed to save cache keys to ", config.warm_keys_file);
+        return;
+    }
+    GFD::threadedCout("Saved ", count, " cache keys to ", config.warm_keys_file);
+}
+
+/// Prints the warming and prefetching counters
+void CacheWarmer::logStats()
+{
+    prefetch_lock.lock();
+    size_t queued = prefetch_queue.size();
+    size_t pages = scan_queue.size();
+    prefetch_lock.unlock();
+    GFD::threadedCout("Warmed: ", stats.warmed.load(), " prefetched: ", stats.prefetched.load(),
+                      " skipped: ", stats.skipped.load(), " failed: ", stats.failed.load(),
+                      " rejected: ", stats.rejected.load(), ", queued pages: ", pages, " links: ", queued);
+}
@@ -9,9 +9,12 @@
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <vector>
 
 #include "GlobalItems.hpp"
 #include "HTTPMessage.hpp"
+#include "ProxyConfig.hpp"
+#include "TimerWheel.hpp"
 
 using std::cout;
 using std::endl;
@@ -20,27 +23,31 @@ using std::string;
 /// Wrapper for a to client HTTP TCP socket
 class ClientSocket
 {
-    static constexpr uint16_t RECV_BUFFER_SIZE = 1024;
     const int test = EWOULDBLOCK;
 
     const int addr_len = sizeof(struct sockaddr_in);
-    uint8_t RECV_BUFFER[RECV_BUFFER_SIZE];
+    std::vector<uint8_t> recv_buffer;
 
     int client_sockfd;
     struct sockaddr_in client_addr;
 
   public:
-    ClientSocket(struct sockaddr_in addr, int sockfd);
+    ClientSocket(struct sockaddr_in addr, int sockfd, const ProxyConfig &config);
     void listenAndAccept();
     void send(const HTTPMessage &item);
+    bool sendRaw(const std::string &bytes);
     int getFD();
+    std::string getAddress() const;
     void disconnect();
-    SocketResult receive();
+    SocketResult receive(PhaseTimer *timer = nullptr);
 };
 
 /// Constructs a client socket
-/// @param port port to listen on
-ClientSocket::ClientSocket(struct sockaddr_in addr, int sockfd)
+/// @param addr address of the client
+/// @param sockfd accepted socket
+/// @param config configuration the connection runs with
+ClientSocket::ClientSocket(struct sockaddr_in addr, int sockfd, const ProxyConfig &config)
+    : recv_buffer(config.recv_buffer_size)
 {
     client_addr = addr;
     client_sockfd = sockfd;
@@ -59,6 +66,14 @@ int ClientSocket::getFD()
     return client_sockfd;
 }
 
+/// Returns the IP address of the client
+std::string ClientSocket::getAddress() const
+{
+    char address[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &client_addr.sin_addr, address, sizeof(address));
+    return address;
+}
+
 /// Sends a message to the client
 /// @param item message to send
 void ClientSocket::send(const HTTPMessage &item)
@@ -79,20 +94,60 @@ void ClientSocket::send(const HTTPMessage &item)
     GFD::threadedCout("Sent ", len, " bytes from ", s.length(), " sized packet to client");
 }
 
+/// Sends bytes to the client as they are, until every byte is written
+/// @param bytes bytes to send
+/// @return false if the client is gone
+bool ClientSocket::sendRaw(const std::string &bytes)
+{
+    size_t sent = 0;
+    while (sent < bytes.length())
+    {
+        errno = 0;
+        ssize_t len = ::send(client_sockfd, bytes.data() + sent, bytes.length() - sent, 0);
+        if (len > 0)
+        {
+            sent += len;
+        }
+        else if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)
+        {
+            return false;
+        }
+    }
+    errno = 0;
+    return true;
+}
+
 /// Receives a message and returns the message and error code from the recv call
-SocketResult ClientSocket::receive()
+/// @param timer deadline to move through the idle, header and body phases
+SocketResult ClientSocket::receive(PhaseTimer *timer)
 {
     std::string s;
     ssize_t status;
     int count = 0;
     HTTPMessage m("");
-    while ((status = recv(client_sockfd, RECV_BUFFER, RECV_BUFFER_SIZE, 0)) > 0)
+    bool headers_complete = false;
+    if (timer)
+    {
+        timer->start(TimeoutPhase::Idle);
+    }
+    while ((status = recv(client_sockfd, recv_buffer.data(), recv_buffer.size(), 0)) > 0)
     {
-        count += status;
         GFD::threadedCout("Receiving message from client");
-        s.append((char *)RECV_BUFFER, status);
+        s.append((char *)recv_buffer.data(), status);
         m = HTTPMessage(s);
-        std::fill_n(RECV_BUFFER, RECV_BUFFER_SIZE, 0);
+        if (timer && !headers_complete)
+        {
+            headers_complete = s.find("\r\n\r\n") != std::string::npos;
+            if (headers_complete)
+            {
+                timer->start(TimeoutPhase::Body);
+            }
+            else if (count == 0)
+            {
+                timer->start(TimeoutPhase::Header);
+            }
+        }
+        count += status;
         int remaining_length = m.getRemainingLength();
         if (remaining_length <= 0)
         {
@@ -102,6 +157,10 @@ SocketResult ClientSocket::receive()
     //    cout << "FILE DESC: " << client_sockfd << endl;
     assert(s.length() == count);
     int err = errno;
+    if (timer)
+    {
+        timer->stop();
+    }
     errno = 0;
     return SocketResult{HTTPMessage(s), status, err};
 }
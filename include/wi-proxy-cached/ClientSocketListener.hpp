@@ -6,11 +6,14 @@
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
+#include <memory>
+#include <poll.h>
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "GlobalItems.hpp"
+#include "ProxyConfig.hpp"
 
 using std::cout;
 using std::endl;
@@ -18,22 +21,30 @@ using std::string;
 
 class ClientSocketListener
 {
-    const int addr_len = sizeof(struct sockaddr_in);
+    static constexpr int ACCEPT_POLL_MS = 100;
 
     int listen_sockfd = -1;
     struct sockaddr_in server_addr;
 
   public:
-    ClientSocketListener(int port);
-    ClientSocket acceptClient();
+    ClientSocketListener(const ProxyConfig &config);
+    ClientSocket acceptClient(std::shared_ptr<const ProxyConfig> config);
     ~ClientSocketListener();
 };
 
-ClientSocketListener::ClientSocketListener(int port)
+/// Binds and listens on the configured port
+/// @param config listener settings
+ClientSocketListener::ClientSocketListener(const ProxyConfig &config)
 {
     listen_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int enable = 1;
+    setsockopt(listen_sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (config.reuse_port)
+    {
+        setsockopt(listen_sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+    }
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
+    server_addr.sin_port = htons(config.port);
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     int result = bind(listen_sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr));
     int flags = fcntl(listen_sockfd, F_GETFL);
@@ -44,8 +55,14 @@ ClientSocketListener::ClientSocketListener(int port)
         exit(1);
     }
     GFD::threadedCout("Bound listener, open for connections");
+#ifdef TCP_FASTOPEN
+    if (config.tcp_fastopen > 0)
+    {
+        setsockopt(listen_sockfd, IPPROTO_TCP, TCP_FASTOPEN, &config.tcp_fastopen, sizeof(config.tcp_fastopen));
+    }
+#endif
     //    cout << "Listening for Client" << endl;
-    if (listen(listen_sockfd, 10) < 0)
+    if (listen(listen_sockfd, config.backlog) < 0)
     {
         GFD::threadedCout("Listen failed");
         exit(1);
@@ -60,13 +77,21 @@ ClientSocketListener::~ClientSocketListener()
     }
 }
 
-ClientSocket ClientSocketListener::acceptClient()
+/// Waits briefly for a client and accepts it, the socket's FD is negative if none arrived
+/// @param config configuration the connection runs with
+ClientSocket ClientSocketListener::acceptClient(std::shared_ptr<const ProxyConfig> config)
 {
     //    cout << "Client found, accepting connection" << endl;
     struct sockaddr_in client_addr;
-    int client_sockfd;
+    socklen_t addr_len = sizeof(client_addr);
+    int client_sockfd = -1;
+    struct pollfd listen_poll = {listen_sockfd, POLLIN, 0};
+    if (poll(&listen_poll, 1, ACCEPT_POLL_MS) <= 0)
+    {
+        return ClientSocket(client_addr, client_sockfd, *config);
+    }
     GFD::executeLockedFD(
-        [&] { client_sockfd = accept(listen_sockfd, (struct sockaddr *)&client_addr, (socklen_t *)&addr_len); });
+        [&] { client_sockfd = accept(listen_sockfd, (struct sockaddr *)&client_addr, &addr_len); });
     //    std::cout << "FROM: " << listen_sockfd << " ESTABLISHED CONNECTION WITH
     //    FD: " << client_sockfd << std::endl;
 //    int flags = fcntl(client_sockfd, F_GETFL);
@@ -78,8 +103,9 @@ ClientSocket ClientSocketListener::acceptClient()
     //    }
     if (client_sockfd > 0)
     {
+        config->applyTo(client_sockfd);
         GFD::threadedCout("Connection established with client IP: ", inet_ntoa(client_addr.sin_addr),
                           " and port: ", ntohs(client_addr.sin_port));
     }
-    return ClientSocket(client_addr, client_sockfd);
+    return ClientSocket(client_addr, client_sockfd, *config);
 }
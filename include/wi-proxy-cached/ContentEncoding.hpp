@@ -0,0 +1,295 @@
+#pragma once
+
+#include <functional>
+#include <sstream>
+#include <string>
+#include <strings.h>
+#include <zlib.h>
+
+#include "GlobalItems.hpp"
+#include "HTTPMessage.hpp"
+
+/// Compresses cacheable responses and negotiates the stored encoding with clients
+class ContentEncoding
+{
+    static constexpr size_t STREAM_CHUNK_SIZE = 16384;
+    static constexpr size_t MIN_COMPRESS_SIZE = 256;
+    static constexpr const char *GZIP_TAG_SUFFIX = "-gzip";
+
+    static bool isTextType(const std::string &content_type);
+    static std::string encodedTag(const std::string &etag);
+    static std::string decodedTag(const std::string &etag);
+    static std::string varyOnEncoding(const std::string &vary);
+
+  public:
+    static bool isCompressible(const HTTPMessage &response);
+    static bool acceptsGzip(const HTTPMessage &request);
+    static std::string gzip(const std::string &data);
+    static bool gunzip(const std::string &data, const std::function<void(const char *, size_t)> &sink);
+    static HTTPMessage compress(const HTTPMessage &response);
+    static HTTPMessage negotiate(const HTTPMessage &stored, const HTTPMessage &request);
+    static bool streamDecoded(const HTTPMessage &stored, const std::function<bool(const std::string &)> &send);
+};
+
+/// Returns true if a content type is text that compresses well
+/// @param content_type value of the Content-Type header
+bool ContentEncoding::isTextType(const std::string &content_type)
+{
+    return content_type.rfind("text/", 0) == 0 || content_type.find("json") != std::string::npos ||
+           content_type.find("javascript") != std::string::npos || content_type.find("xml") != std::string::npos;
+}
+
+/// Returns true if a response should be stored gzip compressed
+/// @param response response from the server
+bool ContentEncoding::isCompressible(const HTTPMessage &response)
+{
+    if (response.to_string().length() < 12 || response.to_string().rfind("HTTP/", 0) != 0 ||
+        response.getStatusCode() != 200)
+    {
+        return false;
+    }
+    std::string encoding = response.getHeader("Content-Encoding");
+    if (!encoding.empty() && encoding != "identity")
+    {
+        return false;
+    }
+    return isTextType(response.getHeader("Content-Type")) && response.getBody().length() >= MIN_COMPRESS_SIZE;
+}
+
+/// Returns true if the request accepts a gzip encoded response
+/// @param request request from the client
+bool ContentEncoding::acceptsGzip(const HTTPMessage &request)
+{
+    std::stringstream codings(request.getHeader("Accept-Encoding"));
+    std::string coding;
+    while (std::getline(codings, coding, ','))
+    {
+        size_t start = coding.find_first_not_of(' ');
+        if (start == std::string::npos)
+        {
+            continue;
+        }
+        size_t params = coding.find(';');
+        std::string name = coding.substr(start, params == std::string::npos ? std::string::npos : params - start);
+        name = name.substr(0, name.find(' '));
+        if (name != "gzip" && name != "x-gzip" && name != "*")
+        {
+            continue;
+        }
+        // A weight of zero explicitly refuses the coding
+        size_t q = coding.find("q=", params == std::string::npos ? coding.length() : params);
+        return q == std::string::npos || std::atof(coding.c_str() + q + 2) > 0;
+    }
+    return false;
+}
+
+/// Compresses data into the gzip format
+/// @param data uncompressed data
+std::string ContentEncoding::gzip(const std::string &data)
+{
+    z_stream stream{};
+    // 15 window bits plus 16 selects the gzip wrapper
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return "";
+    }
+    std::string out;
+    char buffer[STREAM_CHUNK_SIZE];
+    stream.next_in = (Bytef *)data.data();
+    stream.avail_in = data.length();
+    int status;
+    do
+    {
+        stream.next_out = (Bytef *)buffer;
+        stream.avail_out = STREAM_CHUNK_SIZE;
+        status = deflate(&stream, Z_FINISH);
+        out.append(buffer, STREAM_CHUNK_SIZE - stream.avail_out);
+    } while (status == Z_OK);
+    deflateEnd(&stream);
+    return status == Z_STREAM_END ? out : "";
+}
+
+/// Decompresses gzip data one chunk at a time
+/// @param data compressed data
+/// @param sink receives each decompressed chunk
+bool ContentEncoding::gunzip(const std::string &data, const std::function<void(const char *, size_t)> &sink)
+{
+    z_stream stream{};
+    if (inflateInit2(&stream, 15 + 16) != Z_OK)
+    {
+        return false;
+    }
+    char buffer[STREAM_CHUNK_SIZE];
+    stream.next_in = (Bytef *)data.data();
+    stream.avail_in = data.length();
+    int status;
+    do
+    {
+        stream.next_out = (Bytef *)buffer;
+        stream.avail_out = STREAM_CHUNK_SIZE;
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END)
+        {
+            break;
+        }
+        sink(buffer, STREAM_CHUNK_SIZE - stream.avail_out);
+    } while (status != Z_STREAM_END);
+    inflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+/// Returns the entity tag of the gzip variant of a response. A strong tag names exact bytes, so the compressed
+/// bytes get a tag of their own and validators of the uncompressed response never match them.
+/// @param etag entity tag of the uncompressed response
+std::string ContentEncoding::encodedTag(const std::string &etag)
+{
+    if (etag.length() < 2 || etag.front() != '"' || etag.back() != '"')
+    {
+        return etag; //Weak or missing tags only promise equivalent content
+    }
+    return etag.substr(0, etag.length() - 1).append(GZIP_TAG_SUFFIX).append("\"");
+}
+
+/// Returns the entity tag of a decompressed response, the origin's tag if the proxy compressed it and a weak tag
+/// otherwise, since the origin's tag then names the compressed bytes
+/// @param etag entity tag of the gzip variant
+std::string ContentEncoding::decodedTag(const std::string &etag)
+{
+    std::string suffix = std::string(GZIP_TAG_SUFFIX) + "\"";
+    if (etag.length() < 2 || etag.front() != '"' || etag.back() != '"')
+    {
+        return etag;
+    }
+    if (etag.length() >= suffix.length() + 1 &&
+        etag.compare(etag.length() - suffix.length(), suffix.length(), suffix) == 0)
+    {
+        return etag.substr(0, etag.length() - suffix.length()).append("\"");
+    }
+    return "W/" + etag;
+}
+
+/// Adds Accept-Encoding to the request headers a response varies on, keeping the ones named by the origin
+/// @param vary value of the origin's Vary header
+std::string ContentEncoding::varyOnEncoding(const std::string &vary)
+{
+    std::stringstream headers(vary);
+    std::string header;
+    while (std::getline(headers, header, ','))
+    {
+        size_t start = header.find_first_not_of(" \t");
+        size_t end = header.find_last_not_of(" \t");
+        if (start == std::string::npos)
+        {
+            continue;
+        }
+        header = header.substr(start, end - start + 1);
+        if (header == "*" || strcasecmp(header.c_str(), "Accept-Encoding") == 0)
+        {
+            return vary;
+        }
+    }
+    return vary.empty() ? "Accept-Encoding" : vary + ", Accept-Encoding";
+}
+
+/// Returns the gzip encoded variant of a response
+/// @param response uncompressed response from the server
+HTTPMessage ContentEncoding::compress(const HTTPMessage &response)
+{
+    std::string compressed = gzip(response.getBody());
+    if (compressed.empty())
+    {
+        return response;
+    }
+    HTTPMessage encoded(response);
+    encoded.setBody(compressed);
+    encoded.setHeader("Content-Encoding", "gzip");
+    encoded.setHeader("Vary", varyOnEncoding(response.getHeader("Vary")));
+    std::string etag = response.getHeader("ETag");
+    if (!etag.empty())
+    {
+        encoded.setHeader("ETag", encodedTag(etag));
+    }
+    return encoded;
+}
+
+/// Converts a cached response into an encoding the client accepts
+/// @param stored response read from the cache
+/// @param request request from the client
+HTTPMessage ContentEncoding::negotiate(const HTTPMessage &stored, const HTTPMessage &request)
+{
+    if (stored.getHeader("Content-Encoding") != "gzip" || acceptsGzip(request))
+    {
+        return stored;
+    }
+    std::string body;
+    if (!gunzip(stored.getBody(), [&](const char *data, size_t length) { body.append(data, length); }))
+    {
+        GFD::threadedCout("Failed to decompress cached message");
+        return stored;
+    }
+    HTTPMessage decoded(stored);
+    decoded.setBody(body);
+    decoded.removeHeader("Content-Encoding");
+    std::string etag = stored.getHeader("ETag");
+    if (!etag.empty())
+    {
+        decoded.setHeader("ETag", decodedTag(etag));
+    }
+    return decoded;
+}
+
+/// Sends the decompressed form of a gzip stored response while it is inflated, framed in chunked transfer coding,
+/// so the decompressed body is never held in full. The headers go out with the first decompressed chunk.
+/// @param stored gzip encoded response read from the cache
+/// @param send writes bytes to the client, returns false once the client is gone
+/// @return false if nothing was sent because the body could not be decompressed
+bool ContentEncoding::streamDecoded(const HTTPMessage &stored, const std::function<bool(const std::string &)> &send)
+{
+    size_t head_end = stored.to_string().find("\r\n\r\n");
+    if (head_end == std::string::npos)
+    {
+        return false;
+    }
+    std::string status = stored.to_string().substr(0, head_end + 4);
+    if (status.rfind("HTTP/1.0", 0) == 0)
+    {
+        status.replace(0, 8, "HTTP/1.1"); //Chunked coding needs HTTP/1.1 framing
+    }
+    HTTPMessage head(status);
+    head.removeHeader("Content-Encoding");
+    head.removeHeader("Content-Length");
+    head.setHeader("Transfer-Encoding", "chunked");
+    std::string etag = stored.getHeader("ETag");
+    if (!etag.empty())
+    {
+        head.setHeader("ETag", decodedTag(etag));
+    }
+    bool started = false;
+    bool open = true;
+    bool complete = gunzip(stored.getBody(), [&](const char *data, size_t length) {
+        if (length == 0 || !open)
+        {
+            return; //An empty chunk would end the body
+        }
+        std::stringstream frame;
+        frame << std::hex << length << "\r\n";
+        std::string bytes = started ? "" : head.to_string();
+        bytes.append(frame.str()).append(data, length).append("\r\n");
+        started = true;
+        open = send(bytes);
+    });
+    if (!complete)
+    {
+        if (started)
+        {
+            // The client sees the body end without its last chunk, which marks it as incomplete
+            GFD::threadedCout("Failed to decompress cached message");
+        }
+        return started;
+    }
+    if (open)
+    {
+        send(started ? "0\r\n\r\n" : head.to_string() + "0\r\n\r\n");
+    }
+    return true;
+}
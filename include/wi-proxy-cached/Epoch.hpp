@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/// Epoch based reclamation for data that readers use without taking a lock.
+/// Readers hold an Epoch::Guard while they use shared objects. A writer unlinks an object, publishes its
+/// replacement and retires the old object, which is deleted once every reader that could still see it has left
+/// its guard. Entering a guard writes only the calling thread's own slot, so readers never share a written cache line.
+class Epoch
+{
+    /// Epoch a thread entered its guard in, 0 outside of a guard
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<bool> in_use{false};
+        Slot *next = nullptr;
+        int depth = 0; // Nested guards, only touched by the owning thread
+    };
+
+    /// Hands a slot to each thread and gives it back when the thread exits
+    struct SlotOwner
+    {
+        Slot *slot;
+
+        SlotOwner() : slot(acquireSlot()){};
+        ~SlotOwner()
+        {
+            slot->in_use.store(false, std::memory_order_release);
+        }
+    };
+
+    /// Object waiting for the readers of its epoch to leave
+    struct Retired
+    {
+        uint64_t epoch;
+        std::function<void()> destroy;
+    };
+
+    inline static std::atomic<uint64_t> global_epoch{1};
+    inline static std::atomic<Slot *> slots{nullptr}; // Never shrinks, slots of exited threads are reused
+    inline static std::vector<Retired> retired;
+    inline static std::mutex retired_lock;
+
+    static Slot *acquireSlot();
+    static Slot &threadSlot();
+    static void retireWith(std::function<void()> destroy);
+
+  public:
+    /// Marks the calling thread as reading shared objects for its lifetime
+    class Guard
+    {
+        Slot &slot;
+
+      public:
+        Guard();
+        ~Guard();
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+
+    template <typename T> static void retire(const T *object);
+};
+
+/// Takes a free slot, or adds one if every slot belongs to a running thread
+Epoch::Slot *Epoch::acquireSlot()
+{
+    for (Slot *slot = slots.load(std::memory_order_acquire); slot; slot = slot->next)
+    {
+        bool expected = false;
+        if (!slot->in_use.load(std::memory_order_relaxed) && slot->in_use.compare_exchange_strong(expected, true))
+        {
+            return slot;
+        }
+    }
+    Slot *slot = new Slot;
+    slot->in_use = true;
+    slot->next = slots.load(std::memory_order_relaxed);
+    while (!slots.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    return slot;
+}
+
+Epoch::Slot &Epoch::threadSlot()
+{
+    thread_local SlotOwner owner;
+    return *owner.slot;
+}
+
+Epoch::Guard::Guard() : slot(threadSlot())
+{
+    if (slot.depth++ == 0)
+    {
+        // The fence orders the announcement before every load of a shared pointer that follows, it pairs with the
+        // fence in retireWith
+        slot.epoch.store(global_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+Epoch::Guard::~Guard()
+{
+    if (--slot.depth == 0)
+    {
+        slot.epoch.store(0, std::memory_order_release);
+    }
+}
+
+/// Deletes an object once no reader can hold it, the object must already be unreachable for new readers
+/// @param object object replaced by the caller
+template <typename T> void Epoch::retire(const T *object)
+{
+    if (object)
+    {
+        retireWith([object] { delete object; });
+    }
+}
+
+/// Stamps an unlinked object with the current epoch and destroys every retired object whose epoch no reader is
+/// still in
+/// @param destroy deletes the object
+void Epoch::retireWith(std::function<void()> destroy)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // Readers entering from here on see the new epoch, and with it everything published before the increment
+    uint64_t epoch = global_epoch.fetch_add(1, std::memory_order_acq_rel);
+    std::vector<std::function<void()>> ready;
+    retired_lock.lock();
+    retired.push_back(Retired{epoch, std::move(destroy)});
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t oldest = UINT64_MAX;
+    for (Slot *slot = slots.load(std::memory_order_acquire); slot; slot = slot->next)
+    {
+        uint64_t active = slot->epoch.load(std::memory_order_acquire);
+        if (active != 0 && active < oldest)
+        {
+            oldest = active;
+        }
+    }
+    auto waiting = std::partition(retired.begin(), retired.end(),
+                                  [oldest](const Retired &object) { return object.epoch >= oldest; });
+    for (auto object = waiting; object != retired.end(); object++)
+    {
+        ready.push_back(std::move(object->destroy));
+    }
+    retired.erase(waiting, retired.end());
+    retired_lock.unlock();
+    for (std::function<void()> &object : ready)
+    {
+        object();
+    }
+}
@@ -19,6 +19,17 @@ class HTTPMessage
     HTTPMessage(const HTTPMessage &m);
     bool isEmpty() const;
     std::string host();
+    std::string getMethod() const;
+    std::string getTarget() const;
+    std::string hostName() const;
+    int hostPort(int default_port) const;
+    static std::pair<std::string, int> splitAuthority(const std::string& authority, int default_port);
+    std::string getHeader(const std::string& header) const;
+    void setHeader(const std::string& header, const std::string& value);
+    void removeHeader(const std::string& header);
+    std::string getBody() const;
+    static std::string decodeChunked(const std::string& body);
+    void setBody(const std::string& body);
     void addIffModifiedSince(const std::time_t& timestamp);
     int getStatusCode() const;
     int getRemainingLength() const;
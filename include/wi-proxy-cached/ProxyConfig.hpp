@@ -0,0 +1,292 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "GlobalItems.hpp"
+
+/// Runtime settings of the proxy
+struct ProxyConfig
+{
+    // Listener, read once at startup
+    int port = 8082;
+    int workers = 1;         // Accept loops
+    int backlog = 10;
+    bool reuse_port = false; // Gives every worker its own SO_REUSEPORT listener
+    int tcp_fastopen = 0;    // TCP_FASTOPEN queue length, 0 disables
+
+    // Connections, applied to every new connection
+    int upstream_port = 80;      // Used when the Host header has no port
+    bool tcp_nodelay = false;
+    int socket_recv_buffer = 0;  // SO_RCVBUF, 0 keeps the system default
+    int socket_send_buffer = 0;  // SO_SNDBUF, 0 keeps the system default
+    size_t recv_buffer_size = 1024;
+
+    // Deadlines of each connection phase, 0 waits forever
+    int idle_timeout_ms = 60000;       // Until the first byte of a request
+    int header_timeout_ms = 10000;     // From the first byte until the headers are complete
+    int body_timeout_ms = 30000;       // Until a request body is complete, and the longest pause in a response body
+    int connect_timeout_ms = 5000;
+    int first_byte_timeout_ms = 30000; // Until the server starts responding
+    int request_timeout_ms = 300000;   // The whole connection
+    int tunnel_idle_timeout_ms = 300000; // CONNECT tunnels with no traffic either way
+
+    // Cache, read once at startup
+    int cache_size = 500;
+    size_t memory_budget = 32 * 1024 * 1024;
+    size_t hot_slot_count = 64;
+    size_t hot_max_object_size = 64 * 1024;
+
+    // Cache warming and link prefetching
+    std::string warm_list;           // File of requests to fetch into the cache at startup
+    std::string warm_keys_file;      // The most requested keys are saved here and fetched again on the next start
+    size_t warm_top_keys = 200;
+    int warm_dump_interval_s = 300;  // How often the keys are saved, 0 never saves them
+    int warm_concurrency = 4;        // Startup fetches running at once
+    bool prefetch_links = false;     // Fetch the same origin stylesheets, scripts and images linked from HTML
+    int prefetch_rate = 5;           // Prefetches per second
+    int prefetch_max_live_clients = 2; // Prefetching pauses while more clients than this are being served
+    size_t prefetch_queue_size = 256;
+
+    // Admission control, a limit of 0 disables it
+    int max_clients = 0;              // Connections served at once, more are refused with 503
+    int client_rate = 0;              // Requests per second from one client address, more get 429
+    int client_burst = 20;
+    int origin_max_concurrency = 64;  // Requests in flight to one origin
+    int origin_rate = 0;              // Requests per second to one origin
+    int origin_burst = 20;
+    int breaker_window_ms = 10000;    // Span the error rate of an origin is measured over
+    int breaker_min_requests = 20;    // Requests in a window before the breaker may open
+    int breaker_error_percent = 50;   // Share of failed requests that opens the breaker
+    int breaker_slow_ms = 0;          // Responses slower than this count as failed
+    int breaker_open_ms = 30000;      // Time an open breaker fails fast before letting a probe through
+
+    void applyTo(int sockfd) const;
+};
+
+/// Sets the per connection socket options
+/// @param sockfd client or server socket
+void ProxyConfig::applyTo(int sockfd) const
+{
+    int enable = 1;
+    if (tcp_nodelay)
+    {
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+    if (socket_recv_buffer > 0)
+    {
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &socket_recv_buffer, sizeof(socket_recv_buffer));
+    }
+    if (socket_send_buffer > 0)
+    {
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &socket_send_buffer, sizeof(socket_send_buffer));
+    }
+}
+
+/// Loads the configuration from a file and the command line and holds the current snapshot
+class Config
+{
+  public:
+    static bool load(int argc, char **argv);
+    static bool reload();
+    static std::shared_ptr<const ProxyConfig> get();
+
+  private:
+    typedef std::function<void(ProxyConfig &, const std::string &)> Setter;
+
+    inline static std::shared_ptr<const ProxyConfig> current = std::make_shared<const ProxyConfig>();
+    inline static std::vector<std::pair<std::string, std::string>> arguments;
+    inline static std::string path;
+
+    static const std::map<std::string, Setter> &setters();
+    static bool apply(ProxyConfig &config, const std::string &key, const std::string &value);
+    static bool build(ProxyConfig &config);
+};
+
+/// Returns the setter of every configuration key
+const std::map<std::string, Config::Setter> &Config::setters()
+{
+    static const std::map<std::string, Setter> table = {
+        {"port", [](ProxyConfig &c, const std::string &v) { c.port = std::stoi(v); }},
+        {"workers", [](ProxyConfig &c, const std::string &v) { c.workers = std::max(1, std::stoi(v)); }},
+        {"backlog", [](ProxyConfig &c, const std::string &v) { c.backlog = std::stoi(v); }},
+        {"reuse_port", [](ProxyConfig &c, const std::string &v) { c.reuse_port = v == "true" || v == "1"; }},
+        {"tcp_fastopen", [](ProxyConfig &c, const std::string &v) { c.tcp_fastopen = std::stoi(v); }},
+        {"upstream_port", [](ProxyConfig &c, const std::string &v) { c.upstream_port = std::stoi(v); }},
+        {"tcp_nodelay", [](ProxyConfig &c, const std::string &v) { c.tcp_nodelay = v == "true" || v == "1"; }},
+        {"socket_recv_buffer", [](ProxyConfig &c, const std::string &v) { c.socket_recv_buffer = std::stoi(v); }},
+        {"socket_send_buffer", [](ProxyConfig &c, const std::string &v) { c.socket_send_buffer = std::stoi(v); }},
+        {"recv_buffer_size",
+         [](ProxyConfig &c, const std::string &v) { c.recv_buffer_size = std::max(1ul, std::stoul(v)); }},
+        {"idle_timeout_ms", [](ProxyConfig &c, const std::string &v) { c.idle_timeout_ms = std::stoi(v); }},
+        {"header_timeout_ms", [](ProxyConfig &c, const std::string &v) { c.header_timeout_ms = std::stoi(v); }},
+        {"body_timeout_ms", [](ProxyConfig &c, const std::string &v) { c.body_timeout_ms = std::stoi(v); }},
+        {"connect_timeout_ms", [](ProxyConfig &c, const std::string &v) { c.connect_timeout_ms = std::stoi(v); }},
+        {"first_byte_timeout_ms",
+         [](ProxyConfig &c, const std::string &v) { c.first_byte_timeout_ms = std::stoi(v); }},
+        {"request_timeout_ms", [](ProxyConfig &c, const std::string &v) { c.request_timeout_ms = std::stoi(v); }},
+        {"tunnel_idle_timeout_ms",
+         [](ProxyConfig &c, const std::string &v) { c.tunnel_idle_timeout_ms = std::stoi(v); }},
+        {"cache_size", [](ProxyConfig &c, const std::string &v) { c.cache_size = std::max(1, std::stoi(v)); }},
+        {"memory_budget", [](ProxyConfig &c, const std::string &v) { c.memory_budget = std::stoul(v); }},
+        {"hot_slot_count",
+         [](ProxyConfig &c, const std::string &v) { c.hot_slot_count = std::max(1ul, std::stoul(v)); }},
+        {"hot_max_object_size", [](ProxyConfig &c, const std::string &v) { c.hot_max_object_size = std::stoul(v); }},
+        {"warm_list", [](ProxyConfig &c, const std::string &v) { c.warm_list = v; }},
+        {"warm_keys_file", [](ProxyConfig &c, const std::string &v) { c.warm_keys_file = v; }},
+        {"warm_top_keys", [](ProxyConfig &c, const std::string &v) { c.warm_top_keys = std::stoul(v); }},
+        {"warm_dump_interval_s",
+         [](ProxyConfig &c, const std::string &v) { c.warm_dump_interval_s = std::stoi(v); }},
+        {"warm_concurrency",
+         [](ProxyConfig &c, const std::string &v) { c.warm_concurrency = std::max(1, std::stoi(v)); }},
+        {"prefetch_links", [](ProxyConfig &c, const std::string &v) { c.prefetch_links = v == "true" || v == "1"; }},
+        {"prefetch_rate", [](ProxyConfig &c, const std::string &v) { c.prefetch_rate = std::max(1, std::stoi(v)); }},
+        {"prefetch_max_live_clients",
+         [](ProxyConfig &c, const std::string &v) { c.prefetch_max_live_clients = std::stoi(v); }},
+        {"prefetch_queue_size", [](ProxyConfig &c, const std::string &v) { c.prefetch_queue_size = std::stoul(v); }},
+        {"max_clients", [](ProxyConfig &c, const std::string &v) { c.max_clients = std::stoi(v); }},
+        {"client_rate", [](ProxyConfig &c, const std::string &v) { c.client_rate = std::stoi(v); }},
+        {"client_burst", [](ProxyConfig &c, const std::string &v) { c.client_burst = std::max(1, std::stoi(v)); }},
+        {"origin_max_concurrency",
+         [](ProxyConfig &c, const std::string &v) { c.origin_max_concurrency = std::stoi(v); }},
+        {"origin_rate", [](ProxyConfig &c, const std::string &v) { c.origin_rate = std::stoi(v); }},
+        {"origin_burst", [](ProxyConfig &c, const std::string &v) { c.origin_burst = std::max(1, std::stoi(v)); }},
+        {"breaker_window_ms", [](ProxyConfig &c, const std::string &v) { c.breaker_window_ms = std::stoi(v); }},
+        {"breaker_min_requests",
+         [](ProxyConfig &c, const std::string &v) { c.breaker_min_requests = std::max(1, std::stoi(v)); }},
+        {"breaker_error_percent",
+         [](ProxyConfig &c, const std::string &v) { c.breaker_error_percent = std::stoi(v); }},
+        {"breaker_slow_ms", [](ProxyConfig &c, const std::string &v) { c.breaker_slow_ms = std::stoi(v); }},
+        {"breaker_open_ms", [](ProxyConfig &c, const std::string &v) { c.breaker_open_ms = std::stoi(v); }},
+    };
+    return table;
+}
+
+/// Sets one configuration key
+/// @param config configuration being built
+/// @param key setting name
+/// @param value setting value
+bool Config::apply(ProxyConfig &config, const std::string &key, const std::string &value)
+{
+    auto setter = setters().find(key);
+    if (setter == setters().end())
+    {
+        GFD::threadedCout("Unknown configuration key: ", key);
+        return false;
+    }
+    try
+    {
+        setter->second(config, value);
+    }
+    catch (const std::exception &)
+    {
+        GFD::threadedCout("Invalid value for ", key, ": ", value);
+        return false;
+    }
+    return true;
+}
+
+/// Builds a configuration from the file, then the command line arguments on top of it
+/// @param config configuration being built
+bool Config::build(ProxyConfig &config)
+{
+    if (!path.empty())
+    {
+        std::ifstream file(path);
+        if (!file)
+        {
+            GFD::threadedCout("Failed to open configuration file ", path);
+            return false;
+        }
+        // Lines are "key = value", anything after a '#' is a comment
+        std::string line;
+        while (std::getline(file, line))
+        {
+            line = line.substr(0, line.find('#'));
+            size_t equals = line.find('=');
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+            {
+                continue;
+            }
+            if (equals == std::string::npos)
+            {
+                GFD::threadedCout("Malformed configuration line: ", line);
+                return false;
+            }
+            std::string key = line.substr(0, equals);
+            std::string value = line.substr(equals + 1);
+            key.erase(0, key.find_first_not_of(" \t"));
+            key.erase(key.find_last_not_of(" \t") + 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t\r") + 1);
+            if (!apply(config, key, value))
+            {
+                return false;
+            }
+        }
+    }
+    for (auto &argument : arguments)
+    {
+        if (!apply(config, argument.first, argument.second))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Reads the configuration at startup
+/// @param argc argument count from main
+/// @param argv arguments from main, each of the form --key=value, --config=path names the file
+bool Config::load(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        if (argument.rfind("--", 0) != 0 || equals == std::string::npos)
+        {
+            GFD::threadedCout("Arguments must be of the form --key=value: ", argument);
+            return false;
+        }
+        std::string key = argument.substr(2, equals - 2);
+        std::string value = argument.substr(equals + 1);
+        if (key == "config")
+        {
+            path = value;
+        }
+        else
+        {
+            arguments.push_back({key, value});
+        }
+    }
+    return reload();
+}
+
+/// Reads the configuration again, keeping the current one if the new one is invalid.
+/// Connections that are already open keep the snapshot they started with.
+bool Config::reload()
+{
+    ProxyConfig config;
+    if (!build(config))
+    {
+        return false;
+    }
+    std::atomic_store(&current, std::shared_ptr<const ProxyConfig>(std::make_shared<const ProxyConfig>(config)));
+    return true;
+}
+
+/// Returns the current configuration
+std::shared_ptr<const ProxyConfig> Config::get()
+{
+    return std::atomic_load(&current);
+}
@@ -8,13 +8,18 @@
 #include <fcntl.h>
 #include <iostream>
 #include <netdb.h>
+#include <poll.h>
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <chrono>
+#include <memory>
+#include <vector>
 
 #include "GlobalItems.hpp"
 #include "HTTPMessage.hpp"
+#include "ProxyConfig.hpp"
+#include "TimerWheel.hpp"
 
 using std::cout;
 using std::endl;
@@ -23,22 +28,24 @@ using std::string;
 /// Wrapper for a to server HTTP TCP socket
 class ServerSocket
 {
-    static constexpr uint16_t RECV_BUFFER_SIZE = 1024;
-
     const int addr_len = sizeof(struct sockaddr_in);
-    uint8_t RECV_BUFFER[RECV_BUFFER_SIZE];
+    std::shared_ptr<const ProxyConfig> config;
+    std::vector<uint8_t> recv_buffer;
 
     int sockfd = -1;
     struct addrinfo *server_addr = NULL;
     bool connected = false;
+    bool connect_timed_out = false;
 
   public:
-    ServerSocket(){};
+    ServerSocket(std::shared_ptr<const ProxyConfig> config) : config(config), recv_buffer(config->recv_buffer_size){};
     bool connectTo(int port, string addr);
     void send(const HTTPMessage &item);
     bool isConnected();
+    bool connectTimedOut();
+    int getFD();
     void disconnect();
-    SocketResult receive();
+    SocketResult receive(PhaseTimer *timer = nullptr);
     ~ServerSocket();
 };
 
@@ -83,9 +90,30 @@ bool ServerSocket::connectTo(int port, string addr)
 
     GFD::executeLockedFD(
         [&] { sockfd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol); });
+    config->applyTo(sockfd);
 
     GFD::threadedCout("Connecting to server");
+    // Connect without blocking so the attempt can be given up after the connect deadline
+    int flags = fcntl(sockfd, F_GETFL);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
     int conn = connect(sockfd, server_addr->ai_addr, server_addr->ai_addrlen);
+    if (conn < 0 && errno == EINPROGRESS)
+    {
+        struct pollfd connect_poll = {sockfd, POLLOUT, 0};
+        int ready = poll(&connect_poll, 1, config->connect_timeout_ms > 0 ? config->connect_timeout_ms : -1);
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (ready == 0)
+        {
+            connect_timed_out = true;
+            PhaseTimer::recordTimeout(TimeoutPhase::Connect);
+            GFD::threadedCout("Timed out connecting to server");
+        }
+        conn = ready > 0 && err == 0 ? 0 : -1;
+    }
+    fcntl(sockfd, F_SETFL, flags);
+    errno = 0;
     if (conn < 0)
     {
         GFD::threadedCout("Failed to connect to server\n",
@@ -110,6 +138,17 @@ bool ServerSocket::isConnected()
     return connected;
 }
 
+/// Returns true if the last connection attempt ran out of time
+bool ServerSocket::connectTimedOut()
+{
+    return connect_timed_out;
+}
+
+int ServerSocket::getFD()
+{
+    return sockfd;
+}
+
 ServerSocket::~ServerSocket()
 {
     GFD::executeLockedFD([&] { close(sockfd); });
@@ -136,7 +175,8 @@ void ServerSocket::send(const HTTPMessage &item)
 }
 
 /// Receives a message and returns the message and error code from the recv call
-SocketResult ServerSocket::receive()
+/// @param timer deadline to move through the first byte and body phases
+SocketResult ServerSocket::receive(PhaseTimer *timer)
 {
     using namespace std::chrono_literals;
     
@@ -146,13 +186,24 @@ SocketResult ServerSocket::receive()
     errno = 0;
     int lastStatus = -1;
     HTTPMessage m("");
-    while ((status = recv(sockfd, RECV_BUFFER, RECV_BUFFER_SIZE, 0)) > 0)
+    if (timer)
     {
+        timer->start(TimeoutPhase::FirstByte);
+    }
+    while ((status = recv(sockfd, recv_buffer.data(), recv_buffer.size(), 0)) > 0)
+    {
+        if (timer && count == 0)
+        {
+            timer->start(TimeoutPhase::ServerBody);
+        }
+        else if (timer)
+        {
+            timer->restart(); //A large response may take long, only a stalled one runs out of time
+        }
         count += status;
         GFD::threadedCout("Receiving message from server");
-        s.append((char *)RECV_BUFFER, status);
+        s.append((char *)recv_buffer.data(), status);
         m = HTTPMessage(s);
-        std::fill_n(RECV_BUFFER, RECV_BUFFER_SIZE, 0);
         int remaining_length = m.getRemainingLength();
         if (remaining_length <= 0)
         {
@@ -161,6 +212,10 @@ SocketResult ServerSocket::receive()
     }
     //    cout << "FILE DESC: " << sockfd << endl;
     int err = errno;
+    if (timer)
+    {
+        timer->stop();
+    }
     errno = 0;
     return SocketResult{HTTPMessage(s), status, err};
 }
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+#include "GlobalItems.hpp"
+#include "ProxyConfig.hpp"
+
+/// Entry in a timer wheel, owned by the caller and linked into a wheel slot while armed
+struct Timer
+{
+    Timer *prev = nullptr;
+    Timer *next = nullptr;
+    Timer **slot = nullptr; // Head of the slot list holding the timer
+    uint64_t expires = 0; // Tick the timer fires on
+    std::function<void()> callback;
+    bool armed = false;
+};
+
+/// Hierarchical timer wheel with O(1) arm and cancel, driven by its own thread.
+/// Callbacks run on the wheel thread while the wheel is locked, so they must be short
+/// and once cancel returns the callback is guaranteed not to be running.
+class TimerWheel
+{
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+
+    const std::chrono::milliseconds tick_length;
+    const std::chrono::steady_clock::time_point start_time; // Time of tick 0
+    Timer *slots[LEVELS][SLOTS] = {};
+    uint64_t now_tick = 0;
+    std::mutex wheel_lock;
+    std::atomic<bool> running{true};
+    std::thread ticker;
+
+    void place(Timer *timer);
+    void unlink(Timer *timer);
+    void advance();
+    void run();
+
+  public:
+    TimerWheel(std::chrono::milliseconds tick_length = std::chrono::milliseconds(10));
+    ~TimerWheel();
+    void arm(Timer &timer, int delay_ms, std::function<void()> callback);
+    void cancel(Timer &timer);
+};
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick_length)
+    : tick_length(tick_length), start_time(std::chrono::steady_clock::now())
+{
+    ticker = std::thread(&TimerWheel::run, this);
+}
+
+TimerWheel::~TimerWheel()
+{
+    running = false;
+    ticker.join();
+}
+
+/// Links a timer into the slot of the lowest level whose span covers its expiry, wheel_lock must be held
+/// @param timer timer to place
+void TimerWheel::place(Timer *timer)
+{
+    // Timers cascading down on their own tick land in the level 0 slot that is about to fire
+    if (timer->expires < now_tick)
+    {
+        timer->expires = now_tick;
+    }
+    uint64_t delta = timer->expires - now_tick;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1))))
+    {
+        level++;
+    }
+    if (delta >= (uint64_t(1) << (SLOT_BITS * LEVELS)))
+    {
+        timer->expires = now_tick + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+    }
+    Timer *&head = slots[level][(timer->expires >> (SLOT_BITS * level)) & SLOT_MASK];
+    timer->prev = nullptr;
+    timer->next = head;
+    timer->slot = &head;
+    if (head)
+    {
+        head->prev = timer;
+    }
+    head = timer;
+}
+
+/// Removes a timer from whichever slot holds it, wheel_lock must be held
+/// @param timer timer to remove
+void TimerWheel::unlink(Timer *timer)
+{
+    if (timer->prev)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        *timer->slot = timer->next;
+    }
+    if (timer->next)
+    {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = nullptr;
+    timer->next = nullptr;
+}
+
+/// Moves the wheel forward one tick, cascading higher levels down and firing due timers
+void TimerWheel::advance()
+{
+    now_tick++;
+    for (int level = 1; level < LEVELS; level++)
+    {
+        if ((now_tick & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0)
+        {
+            break;
+        }
+        Timer *&head = slots[level][(now_tick >> (SLOT_BITS * level)) & SLOT_MASK];
+        Timer *timer = head;
+        head = nullptr;
+        while (timer)
+        {
+            Timer *next = timer->next;
+            place(timer);
+            timer = next;
+        }
+    }
+    Timer *&head = slots[0][now_tick & SLOT_MASK];
+    Timer *timer = head;
+    head = nullptr;
+    while (timer)
+    {
+        Timer *next = timer->next;
+        timer->prev = nullptr;
+        timer->next = nullptr;
+        timer->armed = false;
+        timer->callback();
+        timer = next;
+    }
+}
+
+void TimerWheel::run()
+{
+    while (running)
+    {
+        std::this_thread::sleep_for(tick_length);
+        uint64_t target = (std::chrono::steady_clock::now() - start_time) / tick_length;
+        wheel_lock.lock();
+        while (now_tick < target)
+        {
+            advance();
+        }
+        wheel_lock.unlock();
+    }
+}
+
+/// Arms or re-arms a timer
+/// @param timer timer to arm, must stay alive until it fires or is cancelled
+/// @param delay_ms milliseconds until the callback runs
+/// @param callback function run on the wheel thread
+void TimerWheel::arm(Timer &timer, int delay_ms, std::function<void()> callback)
+{
+    wheel_lock.lock();
+    if (timer.armed)
+    {
+        unlink(&timer);
+    }
+    timer.callback = std::move(callback);
+    // now_tick trails the clock by up to a tick, or more while the wheel thread is delayed, so the expiry is
+    // rounded up from the clock itself and the callback never runs before delay_ms has passed
+    auto due = std::chrono::steady_clock::now() - start_time + std::chrono::milliseconds(delay_ms);
+    uint64_t expires = (due + tick_length - std::chrono::nanoseconds(1)) / tick_length;
+    timer.expires = std::max(now_tick + 1, expires);
+    timer.armed = true;
+    place(&timer);
+    wheel_lock.unlock();
+}
+
+/// Disarms a timer if it has not fired yet
+/// @param timer timer to cancel
+void TimerWheel::cancel(Timer &timer)
+{
+    wheel_lock.lock();
+    if (timer.armed)
+    {
+        unlink(&timer);
+        timer.armed = false;
+    }
+    wheel_lock.unlock();
+}
+
+/// Phases of a connection that have their own deadline
+enum class TimeoutPhase
+{
+    Idle,        // Waiting for the first byte of a request
+    Header,      // Reading the rest of the request headers
+    Body,        // Reading the request body
+    Connect,     // Connecting to the server
+    FirstByte,   // Waiting for the first byte of the response
+    ServerBody,  // Reading the rest of the response, restarted while data keeps arriving
+    Total,       // The whole connection
+    Count
+};
+
+/// Deadline for the current phase of a connection. Expiry shuts down the watched sockets,
+/// which makes any blocking call on them return.
+class PhaseTimer
+{
+    TimerWheel &wheel;
+    std::shared_ptr<const ProxyConfig> config;
+    Timer timer;
+    std::vector<int> sockets;
+    std::mutex sockets_lock;
+    std::atomic<int> expired_phase{-1};
+    TimeoutPhase phase = TimeoutPhase::Count; // Phase last started, only used by the owning thread
+    std::chrono::steady_clock::time_point started_at;
+
+    inline static std::atomic<uint64_t> timeouts[(int)TimeoutPhase::Count];
+
+    int timeoutFor(TimeoutPhase phase) const;
+
+  public:
+    PhaseTimer(TimerWheel &wheel, std::shared_ptr<const ProxyConfig> config) : wheel(wheel), config(config){};
+    ~PhaseTimer();
+    void watch(int sockfd);
+    void start(TimeoutPhase phase);
+    void restart();
+    void stop();
+    bool expired() const;
+    TimeoutPhase expiredPhase() const;
+
+    static void recordTimeout(TimeoutPhase phase);
+    static const char *phaseName(TimeoutPhase phase);
+    static void logStats();
+};
+
+PhaseTimer::~PhaseTimer()
+{
+    stop();
+}
+
+/// Returns the configured deadline of a phase, 0 if it has none
+/// @param phase connection phase
+int PhaseTimer::timeoutFor(TimeoutPhase phase) const
+{
+    switch (phase)
+    {
+    case TimeoutPhase::Idle:
+        return config->idle_timeout_ms;
+    case TimeoutPhase::Header:
+        return config->header_timeout_ms;
+    case TimeoutPhase::Body:
+    case TimeoutPhase::ServerBody:
+        return config->body_timeout_ms;
+    case TimeoutPhase::Connect:
+        return config->connect_timeout_ms;
+    case TimeoutPhase::FirstByte:
+        return config->first_byte_timeout_ms;
+    case TimeoutPhase::Total:
+        return config->request_timeout_ms;
+    default:
+        return 0;
+    }
+}
+
+/// Adds a socket to shut down when the deadline passes
+/// @param sockfd socket to watch
+void PhaseTimer::watch(int sockfd)
+{
+    sockets_lock.lock();
+    sockets.push_back(sockfd);
+    sockets_lock.unlock();
+}
+
+/// Starts the deadline of a phase, replacing the deadline of the previous one
+/// @param phase phase being entered
+void PhaseTimer::start(TimeoutPhase phase)
+{
+    this->phase = phase;
+    started_at = std::chrono::steady_clock::now();
+    int timeout_ms = timeoutFor(phase);
+    if (timeout_ms <= 0)
+    {
+        wheel.cancel(timer);
+        return;
+    }
+    wheel.arm(timer, timeout_ms, [this, phase] {
+        expired_phase = (int)phase;
+        recordTimeout(phase);
+        sockets_lock.lock();
+        for (int sockfd : sockets)
+        {
+            shutdown(sockfd, SHUT_RDWR);
+        }
+        sockets_lock.unlock();
+    });
+}
+
+/// Restarts the deadline of the current phase after progress, which turns it into a limit on inactivity.
+/// The wheel is only touched once a quarter of the deadline has passed, so a fast transfer doesn't re-arm on every
+/// read, and the phase expires after at least three quarters of its deadline without progress.
+void PhaseTimer::restart()
+{
+    int timeout_ms = timeoutFor(phase);
+    if (timeout_ms > 0 && std::chrono::steady_clock::now() - started_at >= std::chrono::milliseconds(timeout_ms / 4))
+    {
+        start(phase);
+    }
+}
+
+/// Stops the deadline, the watched sockets can be closed once this returns
+void PhaseTimer::stop()
+{
+    wheel.cancel(timer);
+}
+
+bool PhaseTimer::expired() const
+{
+    return expired_phase >= 0;
+}
+
+TimeoutPhase PhaseTimer::expiredPhase() const
+{
+    return (TimeoutPhase)expired_phase.load();
+}
+
+/// Counts a timeout
+/// @param phase phase that ran out of time
+void PhaseTimer::recordTimeout(TimeoutPhase phase)
+{
+    timeouts[(int)phase]++;
+}
+
+const char *PhaseTimer::phaseName(TimeoutPhase phase)
+{
+    static const char *names[] = {"idle", "header", "body", "connect", "first byte", "server body", "total"};
+    return names[(int)phase];
+}
+
+/// Prints the number of timeouts in each phase
+void PhaseTimer::logStats()
+{
+    std::stringstream line;
+    line << "Timeouts";
+    for (int phase = 0; phase < (int)TimeoutPhase::Count; phase++)
+    {
+        line << (phase == 0 ? " " : ", ") << phaseName((TimeoutPhase)phase) << ": " << timeouts[phase].load();
+    }
+    GFD::threadedCout(line.str());
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "GlobalItems.hpp"
+#include "ProxyConfig.hpp"
+
+/// Totals across every tunnel since startup
+struct TunnelStats
+{
+    std::atomic<uint64_t> opened{0};
+    std::atomic<uint64_t> active{0};
+    std::atomic<uint64_t> bytes_up{0};
+    std::atomic<uint64_t> bytes_down{0};
+};
+
+/// One direction of a tunnel. On Linux the bytes move through a pipe with splice and never enter user space.
+struct TunnelDirection
+{
+    int from;
+    int to;
+    int pipe_fds[2] = {-1, -1};
+    size_t pending = 0;     // Bytes read but not yet written
+    bool read_done = false; // The sender has closed its side
+    bool done = false;      // Everything was forwarded and the write side is shut down
+    uint64_t bytes = 0;
+#ifndef __linux__
+    char buffer[16384];
+    size_t offset = 0;
+#endif
+};
+
+/// Relays bytes both ways between a client and a server after a CONNECT request
+class Tunnel
+{
+    static constexpr size_t SPLICE_CHUNK_SIZE = 65536;
+
+    TunnelDirection up;   // Client to server
+    TunnelDirection down; // Server to client
+    const int idle_timeout_ms;
+
+    inline static TunnelStats stats;
+
+    bool fill(TunnelDirection &direction);
+    bool drain(TunnelDirection &direction);
+
+  public:
+    Tunnel(int client_sockfd, int server_sockfd, const ProxyConfig &config);
+    ~Tunnel();
+    void relay();
+
+    static void logStats();
+};
+
+/// Sets up a tunnel, the sockets stay owned by the caller
+/// @param client_sockfd socket of the client that sent CONNECT
+/// @param server_sockfd connected socket of the requested host
+/// @param config configuration the connection runs with
+Tunnel::Tunnel(int client_sockfd, int server_sockfd, const ProxyConfig &config)
+    : idle_timeout_ms(config.tunnel_idle_timeout_ms)
+{
+    up.from = down.to = client_sockfd;
+    up.to = down.from = server_sockfd;
+#ifdef __linux__
+    if (pipe2(up.pipe_fds, O_NONBLOCK) < 0 || pipe2(down.pipe_fds, O_NONBLOCK) < 0)
+    {
+        GFD::threadedCout("Failed to create tunnel pipes");
+        up.done = down.done = true;
+    }
+#endif
+    for (int sockfd : {client_sockfd, server_sockfd})
+    {
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    }
+    stats.opened++;
+    stats.active++;
+}
+
+Tunnel::~Tunnel()
+{
+    for (TunnelDirection *direction : {&up, &down})
+    {
+        for (int fd : direction->pipe_fds)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    }
+    stats.active--;
+    stats.bytes_up += up.bytes;
+    stats.bytes_down += down.bytes;
+    GFD::threadedCout("Tunnel closed, ", up.bytes, " bytes to server, ", down.bytes, " bytes to client");
+}
+
+/// Reads what the sending side has available
+/// @param direction direction to read for
+/// @return false if the tunnel failed
+bool Tunnel::fill(TunnelDirection &direction)
+{
+#ifdef __linux__
+    ssize_t moved = splice(direction.from, nullptr, direction.pipe_fds[1], nullptr, SPLICE_CHUNK_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    ssize_t moved = recv(direction.from, direction.buffer, sizeof(direction.buffer), 0);
+    direction.offset = 0;
+#endif
+    if (moved > 0)
+    {
+        direction.pending += moved;
+        return true;
+    }
+    if (moved == 0)
+    {
+        direction.read_done = true;
+        return true;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/// Writes what was read to the receiving side, shutting its write side once the sender closed and everything went
+/// through
+/// @param direction direction to write for
+/// @return false if the tunnel failed
+bool Tunnel::drain(TunnelDirection &direction)
+{
+    if (direction.pending > 0)
+    {
+#ifdef __linux__
+        ssize_t moved = splice(direction.pipe_fds[0], nullptr, direction.to, nullptr, direction.pending,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+        ssize_t moved = ::send(direction.to, direction.buffer + direction.offset, direction.pending, 0);
+        direction.offset += moved > 0 ? moved : 0;
+#endif
+        if (moved < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        direction.pending -= moved;
+        direction.bytes += moved;
+    }
+    if (direction.read_done && direction.pending == 0 && !direction.done)
+    {
+        shutdown(direction.to, SHUT_WR); // Pass the half close on
+        direction.done = true;
+    }
+    return true;
+}
+
+/// Relays until both sides have closed, either side fails or the tunnel is idle for too long
+void Tunnel::relay()
+{
+    while (!up.done || !down.done)
+    {
+        // Wait for readable senders while nothing is pending, and for writable receivers otherwise
+        struct pollfd polls[2];
+        TunnelDirection *directions[2] = {&up, &down};
+        nfds_t count = 0;
+        for (TunnelDirection *direction : directions)
+        {
+            if (direction->done)
+            {
+                continue;
+            }
+            polls[count].fd = direction->pending > 0 ? direction->to : direction->from;
+            polls[count].events = direction->pending > 0 ? POLLOUT : POLLIN;
+            polls[count].revents = 0;
+            count++;
+        }
+        int ready = poll(polls, count, idle_timeout_ms > 0 ? idle_timeout_ms : -1);
+        if (ready == 0)
+        {
+            GFD::threadedCout("Tunnel idle for ", idle_timeout_ms, " ms, closing");
+            return;
+        }
+        if (ready < 0 && errno != EINTR)
+        {
+            return;
+        }
+        for (TunnelDirection *direction : directions)
+        {
+            if (direction->done)
+            {
+                continue;
+            }
+            if (direction->pending == 0 && !direction->read_done && !fill(*direction))
+            {
+                return;
+            }
+            if (!drain(*direction))
+            {
+                return;
+            }
+        }
+    }
+}
+
+/// Prints the totals of every tunnel
+void Tunnel::logStats()
+{
+    GFD::threadedCout("Tunnels opened: ", stats.opened.load(), " active: ", stats.active.load(),
+                      ", bytes to servers: ", stats.bytes_up.load(), " bytes to clients: ", stats.bytes_down.load());
+}
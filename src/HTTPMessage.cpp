@@ -1,11 +1,13 @@
 #include "HTTPMessage.hpp"
 #include "GlobalItems.hpp"
 #include <algorithm>
+#include <climits>
 #include <cstring>
 #include <iostream>
 #include <string>
 #include <ctime>
 #include <iomanip>
+#include <strings.h>
 
 #define CRLF "\r\n"
 #define HEADER_SPLIT "\r\n\r\n"
@@ -36,48 +38,118 @@ string HTTPMessage::host()
     return hostname;
 }
 
+/// Gets the method from the request line
+std::string HTTPMessage::getMethod() const
+{
+    return raw_text.substr(0, raw_text.find(' '));
+}
+
+/// Gets the request target from the request line
+std::string HTTPMessage::getTarget() const
+{
+    size_t start = raw_text.find(' ');
+    if (start == string::npos)
+    {
+        return "";
+    }
+    start++;
+    return raw_text.substr(start, raw_text.find_first_of(" \r", start) - start);
+}
+
+/// Gets the hostname without the port
+std::string HTTPMessage::hostName() const
+{
+    return splitAuthority(hostname, 0).first;
+}
+
+/// Gets the port from the Host header
+/// @param default_port port to use when the header has none
+int HTTPMessage::hostPort(int default_port) const
+{
+    return splitAuthority(hostname, default_port).second;
+}
+
+/// Splits a host:port pair such as a Host header or a CONNECT target
+/// @param authority host, optionally followed by a colon and a port
+/// @param default_port port to use when there is none
+std::pair<std::string, int> HTTPMessage::splitAuthority(const std::string& authority, int default_port)
+{
+    size_t colon = authority.rfind(':');
+    // A colon inside brackets belongs to an IPv6 address
+    if (colon == string::npos || authority.find(']', colon) != string::npos)
+    {
+        colon = authority.length();
+    }
+    string name = authority.substr(0, colon);
+    if (name.length() >= 2 && name.front() == '[' && name.back() == ']')
+    {
+        name = name.substr(1, name.length() - 2);
+    }
+    int port = colon < authority.length() ? std::atoi(authority.c_str() + colon + 1) : 0;
+    return {name, port > 0 && port <= 65535 ? port : default_port};
+}
+
 /// Returns true if the message is empty
 bool HTTPMessage::isEmpty() const
 {
     return raw_text.empty();
 }
 
+/// Gets the status code of a response, 0 if the status line is too short to hold one
 int HTTPMessage::getStatusCode() const
 {
+    if (raw_text.length() < 12)
+    {
+        return 0;
+    }
     string top_line = raw_text.substr(9, 3);
     return std::atoi(top_line.data());
 }
 
-/// Parses header
-std::string HTTPMessage::parseHeader(const std::string& header) const
+/// Finds the CRLF that starts a header line, header names are case insensitive
+/// @param text message text
+/// @param header header name
+/// @return position of the CRLF before the header, npos if it is not present
+static size_t findHeader(const string& text, const string& header)
 {
-    int split_loc = 0;
-    if (!isEmpty())
+    size_t split_loc = text.find(HEADER_SPLIT);
+    size_t pos = text.find(CRLF);
+    while (pos != string::npos && (split_loc == string::npos || pos < split_loc))
     {
-        split_loc = raw_text.find(HEADER_SPLIT);
-        string headers = raw_text.substr(0, split_loc);
-        // Search for "\r\nHost: *\r\n"
-        const string pre = string("\r\n").append(header).append(": ");
-        const string post = "\r\n";
-        size_t pre_loc = headers.find(pre);
-        if (pre_loc != string::npos)
+        size_t name = pos + 2;
+        if (name + header.length() < text.length() && text[name + header.length()] == ':' &&
+            strncasecmp(text.data() + name, header.data(), header.length()) == 0)
         {
-            pre_loc += pre.length();
-            string pre_cut = headers.substr(pre_loc, headers.length() - pre_loc);
-            size_t post_loc = pre_cut.find(post);
-            if (post_loc != string::npos)
-            {
-                string post_cut = pre_cut.substr(0, post_loc);
-                return post_cut;
-            }
+            return pos;
         }
+        pos = text.find(CRLF, name);
     }
-    return "";
+    return string::npos;
+}
+
+/// Parses header
+std::string HTTPMessage::parseHeader(const std::string& header) const
+{
+    // Search for "\r\nHost: *\r\n"
+    size_t pre_loc = findHeader(raw_text, header);
+    if (pre_loc == string::npos)
+    {
+        return "";
+    }
+    size_t value_loc = raw_text.find_first_not_of(" \t", pre_loc + 2 + header.length() + 1);
+    size_t post_loc = raw_text.find(CRLF, pre_loc + 2);
+    if (post_loc == string::npos || value_loc == string::npos || value_loc > post_loc)
+    {
+        return "";
+    }
+    string value = raw_text.substr(value_loc, post_loc - value_loc);
+    value.erase(value.find_last_not_of(" \t") + 1);
+    return value;
 }
 
 std::string HTTPMessage::parseBody() const
 {
-    int split_loc = 0;
+    size_t split_loc = 0;
     if (!isEmpty())
     {
         split_loc = raw_text.find(HEADER_SPLIT);
@@ -91,6 +163,109 @@ std::string HTTPMessage::parseBody() const
     return "";
 }
 
+/// Removes the chunked transfer coding from a body
+/// @param body chunked body
+std::string HTTPMessage::decodeChunked(const std::string& body)
+{
+    std::string decoded;
+    size_t pos = 0;
+    while (pos < body.length())
+    {
+        size_t line_end = body.find(CRLF, pos);
+        if (line_end == string::npos)
+        {
+            break;
+        }
+        // Chunk extensions after ';' are ignored
+        size_t length = std::strtoul(body.substr(pos, line_end - pos).c_str(), nullptr, 16);
+        if (length == 0)
+        {
+            break;
+        }
+        pos = line_end + 2;
+        // A chunk running past the end is truncated, and sizes near SIZE_MAX must not wrap pos around
+        if (length > body.length() - pos)
+        {
+            decoded.append(body, pos, string::npos);
+            break;
+        }
+        decoded.append(body, pos, length);
+        pos += length;
+        if (body.length() - pos < 2)
+        {
+            break;
+        }
+        pos += 2;
+    }
+    return decoded;
+}
+
+/// Gets the value of a header, empty if it is not present
+/// @param header header name
+std::string HTTPMessage::getHeader(const std::string& header) const
+{
+    return parseHeader(header);
+}
+
+/// Replaces a header or adds it if it is not present
+/// @param header header name
+/// @param value new header value
+void HTTPMessage::setHeader(const std::string& header, const std::string& value)
+{
+    removeHeader(header);
+    size_t split_loc = raw_text.find(HEADER_SPLIT);
+    if (split_loc == string::npos)
+    {
+        return;
+    }
+    raw_text.insert(split_loc, string(CRLF).append(header).append(": ").append(value));
+    if (strcasecmp(header.c_str(), "Host") == 0)
+    {
+        hostname = value;
+    }
+}
+
+/// Removes every occurrence of a header
+/// @param header header name
+void HTTPMessage::removeHeader(const std::string& header)
+{
+    size_t pre_loc;
+    while ((pre_loc = findHeader(raw_text, header)) != string::npos)
+    {
+        size_t post_loc = raw_text.find(CRLF, pre_loc + 2);
+        raw_text.erase(pre_loc, post_loc - pre_loc);
+    }
+    if (strcasecmp(header.c_str(), "Host") == 0)
+    {
+        hostname = "";
+    }
+}
+
+/// Gets the body with any chunked transfer coding removed
+std::string HTTPMessage::getBody() const
+{
+    if (parseHeader("Transfer-Encoding").find("chunked") != string::npos)
+    {
+        return decodeChunked(parseBody());
+    }
+    return parseBody();
+}
+
+/// Replaces the body and frames it with a Content-Length header
+/// @param body new body
+void HTTPMessage::setBody(const std::string& body)
+{
+    size_t split_loc = raw_text.find(HEADER_SPLIT);
+    if (split_loc == string::npos)
+    {
+        return;
+    }
+    raw_text.erase(split_loc + 4);
+    raw_text.append(body);
+    removeHeader("Transfer-Encoding");
+    setHeader("Content-Length", std::to_string(body.length()));
+}
+
 std::ostream &operator<<(std::ostream &out, const HTTPMessage &msg)
 {
     return out << msg.raw_text;
@@ -110,8 +285,11 @@ void HTTPMessage::addIffModifiedSince(const std::time_t& timestamp)
     std::stringstream data;
     data << "\r\nIf-Modified-Since: ";
     data << std::put_time(gmt_time, "%a, %d %b %Y %T GMT");
-    GFD::threadedCout("ADDED MODIFICATION DATE: ", data.str());
-    raw_text.insert(raw_text.find("\r\n\r\n"), data.str());
+    size_t split_loc = raw_text.find(HEADER_SPLIT);
+    if (split_loc != string::npos)
+    {
+        raw_text.insert(split_loc, data.str());
+    }
     date_mutex.unlock();
 }
 
@@ -147,9 +325,14 @@ int HTTPMessage::getRemainingLength() const
     }
     else if (is_content)
     {
-        if (body.empty())
+        if (raw_text.find(HEADER_SPLIT) == std::string::npos) //Headers incomplete
+        {
             return 1600;
-        return std::stoi(content_length_header) - body.length();
+        }
+        // Malformed lengths read as 0 rather than throwing on untrusted input
+        long long content_length = std::strtoll(content_length_header.c_str(), nullptr, 10);
+        long long remaining = content_length - (long long)body.length();
+        return (int)std::min<long long>(remaining, INT_MAX);
     }
     else
     {
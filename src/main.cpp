@@ -2,16 +2,26 @@
 #include "ClientSocketListener.hpp"
 #include "GlobalItems.hpp"
 #include "HTTPMessage.hpp"
+#include "ProxyConfig.hpp"
 #include "ServerSocket.hpp"
+#include "TimerWheel.hpp"
+#include "Tunnel.hpp"
 #include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <cmath>
+#include <csignal>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <string>
 #include <thread>
 #include <utility>
+#include <vector>
 #include "CacheStorage.hpp"
+#include "ByteRange.hpp"
+#include "CacheWarmer.hpp"
+#include "AdmissionControl.hpp"
 
 using namespace std::chrono_literals;
 
@@ -19,17 +29,144 @@ using std::cout;
 using std::endl;
 using std::string;
 
-static CacheStorage cache;
+static std::unique_ptr<CacheStorage> cache;
+static std::unique_ptr<TimerWheel> timers;
+static std::unique_ptr<CacheWarmer> warmer;
+static std::unique_ptr<AdmissionControl> admission;
+static volatile std::sig_atomic_t stats_requested = 0;
+static volatile std::sig_atomic_t reload_requested = 0;
 
-void threadRunner(ClientSocket client)
+void requestStats(int)
 {
-    ServerSocket server;
+    stats_requested = 1;
+}
+
+void requestReload(int)
+{
+    reload_requested = 1;
+}
+
+/// Connects to the target of a CONNECT request and relays bytes both ways until the tunnel ends.
+/// The admission of the request is released once the target answers or fails, so open tunnels don't hold
+/// the origin's concurrency slots for as long as the client keeps them.
+/// @param client client that sent the request
+/// @param server unconnected server socket
+/// @param request CONNECT request
+/// @param origin host and port the request was admitted for
+/// @param probe the request was admitted as the probe of a half open breaker
+/// @param config configuration the connection runs with
+/// @param total_timer deadline of the whole connection
+void runTunnel(ClientSocket &client, ServerSocket &server, HTTPMessage &request, const std::string &origin,
+               bool probe, std::shared_ptr<const ProxyConfig> config, PhaseTimer &total_timer)
+{
+    std::pair<std::string, int> target = HTTPMessage::splitAuthority(request.getTarget(), 443);
+    GFD::threadedCout("Opening tunnel to ", target.first, ":", target.second);
+    auto connect_start = std::chrono::steady_clock::now();
+    bool connected = server.connectTo(target.second, target.first);
+    // Only reaching the target counts for the breaker
+    admission->release(origin, probe, !connected,
+                       std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                                             connect_start),
+                       *config);
+    if (!connected)
+    {
+        if (server.connectTimedOut())
+        {
+            client.send(HTTPMessage("HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n"));
+        }
+        else
+        {
+            client.send(HTTPMessage("HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n"));
+        }
+        return;
+    }
+    // Tunnels are long lived, only the idle timeout of the relay applies to them
+    total_timer.stop();
+    client.send(HTTPMessage("HTTP/1.1 200 Connection Established\r\n\r\n"));
+    // Anything the client sent after the request headers already belongs to the tunnel
+    std::string early_data = request.getBody();
+    if (!early_data.empty())
+    {
+        server.send(HTTPMessage(early_data));
+    }
+    Tunnel tunnel(client.getFD(), server.getFD(), *config);
+    tunnel.relay();
+}
+
+/// Sends a response read from the cache. A gzip copy is decompressed chunk by chunk on its way to a client that
+/// doesn't accept gzip, ranges and HTTP/1.0 clients, which can't take chunked coding, get a negotiated copy.
+/// @param client client that sent the request
+/// @param stored response as the cache stores it
+/// @param request request from the client
+void sendCached(ClientSocket &client, const HTTPMessage &stored, const HTTPMessage &request)
+{
+    const std::string &text = request.to_string();
+    size_t line_end = text.find("\r\n");
+    bool chunked_client =
+        line_end != std::string::npos && line_end >= 8 && text.compare(line_end - 8, 8, "HTTP/1.1") == 0;
+    if (stored.getHeader("Content-Encoding") == "gzip" && !ContentEncoding::acceptsGzip(request) &&
+        request.getMethod() == "GET" && request.getHeader("Range").empty() && chunked_client &&
+        ContentEncoding::streamDecoded(stored, [&client](const std::string &bytes) { return client.sendRaw(bytes); }))
+    {
+        return;
+    }
+    client.send(ByteRange::serve(ContentEncoding::negotiate(stored, request), request));
+}
+
+/// Answers a request that admission control turned away, with the cached copy if there is one
+/// @param client client that sent the request
+/// @param request request from the client
+/// @param cached cache entry of the request
+/// @param origin host and port the request was for
+/// @param rejection reason the request was turned away
+void rejectRequest(ClientSocket &client, HTTPMessage &request, const std::optional<CacheHit> &cached,
+                   const std::string &origin, Admission rejection)
+{
+    GFD::threadedCout("Request to ", origin, " rejected, ", AdmissionControl::admissionName(rejection));
+    std::optional<HTTPMessage> stale = cached ? cache->readItem(*cached) : std::nullopt;
+    if (stale)
+    {
+        stale->setHeader("Warning", "110 - \"Response is Stale\"");
+        sendCached(client, *stale, request);
+        admission->recordStale(origin);
+        return;
+    }
+    client.send(HTTPMessage("HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n"));
+}
+
+void threadRunner(ClientSocket client, std::shared_ptr<const ProxyConfig> config)
+{
+    ServerSocket server(config);
+    // Only opened when a cached copy is evicted while the server confirms it
+    std::optional<ServerSocket> refetch_server;
+    // Expired deadlines shut the sockets down, which ends whatever call is blocked on them
+    PhaseTimer client_timer(*timers, config);
+    PhaseTimer server_timer(*timers, config);
+    PhaseTimer total_timer(*timers, config);
+    warmer->clientOpened();
+    client_timer.watch(client.getFD());
+    total_timer.watch(client.getFD());
+    total_timer.start(TimeoutPhase::Total);
     bool client_would_block, server_would_block;
+    // Admitted requests report back whether the origin answered and how long it took
+    std::string origin;
+    bool origin_admitted = false;
+    bool origin_probe = false;
+    bool origin_failed = true;
+    auto origin_start = std::chrono::steady_clock::now();
+    std::optional<std::chrono::milliseconds> origin_latency;
     while (true)
     {
         // Read client message
-        SocketResult client_result = client.receive();
+        SocketResult client_result = client.receive(&client_timer);
         client_would_block = client_result.err == EWOULDBLOCK;
+        if (client_timer.expired() || total_timer.expired())
+        {
+            PhaseTimer &expired = client_timer.expired() ? client_timer : total_timer;
+            GFD::threadedCout("Client timed out in ", PhaseTimer::phaseName(expired.expiredPhase()),
+                              " phase, resetting socket");
+            break;
+        }
         // If an error occurred, reset connection
         if (client_result.status <= 0 && !client_would_block)
         {
@@ -45,59 +182,236 @@ void threadRunner(ClientSocket client)
         {
             continue;
         }
+        if (!admission->admitClient(client.getAddress(), *config))
+        {
+            GFD::threadedCout("Client ", client.getAddress(), " rate limited");
+            client.send(HTTPMessage("HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n"));
+            break;
+        }
+        if (client_result.message.getMethod() == "CONNECT")
+        {
+            std::pair<std::string, int> target = HTTPMessage::splitAuthority(client_result.message.getTarget(), 443);
+            origin = target.first + ":" + std::to_string(target.second);
+            std::optional<CacheHit> no_cache;
+            Admission decision = admission->admitOrigin(origin, *config, origin_probe);
+            if (decision != Admission::Admitted)
+            {
+                rejectRequest(client, client_result.message, no_cache, origin, decision);
+                break;
+            }
+            runTunnel(client, server, client_result.message, origin, origin_probe, config, total_timer);
+            break;
+        }
+        HTTPMessage no_modified = HTTPMessage(client_result.message);
+        std::optional<CacheHit> cached_msg = cache->lookupItem(no_modified);
+        origin = client_result.message.hostName() + ":" +
+                 std::to_string(client_result.message.hostPort(config->upstream_port));
+        Admission decision = admission->admitOrigin(origin, *config, origin_probe);
+        if (decision != Admission::Admitted)
+        {
+            rejectRequest(client, no_modified, cached_msg, origin, decision);
+            break;
+        }
+        origin_admitted = true;
+        origin_start = std::chrono::steady_clock::now();
         GFD::threadedCout("Successful connection");
-        if (server.connectTo(80, client_result.message.host()) == false)
+        if (server.connectTo(client_result.message.hostPort(config->upstream_port),
+                             client_result.message.hostName()) == false)
         {
-            client.send(HTTPMessage("HTTP/1.1 400 Bad Request\r\n\r\n"));
+            if (server.connectTimedOut())
+            {
+                client.send(HTTPMessage("HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n"));
+            }
+            else
+            {
+                client.send(HTTPMessage("HTTP/1.1 400 Bad Request\r\n\r\n"));
+            }
             break;
         }
+        server_timer.watch(server.getFD());
+        total_timer.watch(server.getFD());
         // If we have a server connection, send packet and poll receive
-        bool cached_msg = false;
-        HTTPMessage no_modified = HTTPMessage(client_result.message);
-        if (cache.containsItem(client_result.message))
+        if (cached_msg)
         {
+            // Revalidate the full copy, every range is then served from it
             GFD::threadedCout("Found cached message");
-            cached_msg = true;
-            client_result.message.addIffModifiedSince(cache.getTimestamp(client_result.message));
+            client_result.message.removeHeader("Range");
+            client_result.message.removeHeader("If-Range");
+            client_result.message.addIffModifiedSince(cached_msg->timestamp);
         }
+        // Without a cached copy the client's Range goes to the server, so a partial request doesn't fetch the whole
+        // object. A 206 answer is passed through and not stored, a full answer is stored and sliced here.
         server.send(client_result.message);
-        SocketResult server_result = server.receive();
+        SocketResult server_result = server.receive(&server_timer);
+        origin_latency =
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - origin_start);
         server_would_block = server_result.err == EWOULDBLOCK;
+        if (total_timer.expired())
+        {
+            GFD::threadedCout("Request timed out");
+            break;
+        }
+        if (server_timer.expired())
+        {
+            GFD::threadedCout("Server timed out in ", PhaseTimer::phaseName(server_timer.expiredPhase()), " phase");
+            client.send(HTTPMessage("HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n"));
+            break;
+        }
+        origin_failed = server_result.message.isEmpty() || server_result.message.getStatusCode() >= 500;
         
-        if (!server_result.message.isEmpty() && server_result.message.getStatusCode() == 304)
+        // The cached copy is only read once the server confirmed it
+        std::optional<HTTPMessage> cached_response;
+        if (cached_msg && !server_result.message.isEmpty() && server_result.message.getStatusCode() == 304)
+        {
+            cached_response = cache->readItem(*cached_msg);
+            if (!cached_response)
+            {
+                GFD::threadedCout("Cached message evicted, fetching it again");
+                client_result.message.removeHeader("If-Modified-Since");
+                refetch_server.emplace(config);
+                if (!refetch_server->connectTo(client_result.message.hostPort(config->upstream_port),
+                                               client_result.message.hostName()))
+                {
+                    origin_failed = true;
+                    client.send(HTTPMessage("HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n"));
+                    break;
+                }
+                server_timer.watch(refetch_server->getFD());
+                total_timer.watch(refetch_server->getFD());
+                refetch_server->send(client_result.message);
+                server_result = refetch_server->receive(&server_timer);
+                origin_latency = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - origin_start);
+                if (server_timer.expired() || total_timer.expired())
+                {
+                    GFD::threadedCout("Server timed out fetching the evicted message");
+                    client.send(HTTPMessage("HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n"));
+                    break;
+                }
+                origin_failed = server_result.message.isEmpty() || server_result.message.getStatusCode() >= 500;
+            }
+        }
+        if (cached_response)
         {
             GFD::threadedCout("Message unmodified");
-            string s = cache.getItem(no_modified).to_string();
-            GFD::threadedCout("FOUND CACHED MESSAGE of size ", s.length(), " bytes");
-            client.send(s);
-            cache.refreshItem(no_modified);
+            GFD::threadedCout("FOUND CACHED MESSAGE of size ", cached_response->to_string().length(), " bytes");
+            sendCached(client, *cached_response, no_modified);
+            cache->refreshItem(no_modified);
         }
         else
         {
-            client.send(server_result.message.to_string());
-            cache.insertItem(no_modified, server_result.message);
+            client.send(ByteRange::serve(server_result.message, no_modified));
+            cache->insertItem(no_modified, server_result.message);
+            warmer->scanLinks(no_modified, server_result.message);
         }
         break;
     }
+    // No deadline may fire on the descriptors once they are closed and reused
+    total_timer.stop();
+    client_timer.stop();
+    server_timer.stop();
     client.disconnect();
+    if (origin_admitted)
+    {
+        // Requests that never got a response are timed until they were given up
+        admission->release(origin, origin_probe, origin_failed,
+                           origin_latency.value_or(std::chrono::duration_cast<std::chrono::milliseconds>(
+                               std::chrono::steady_clock::now() - origin_start)),
+                           *config);
+    }
+    warmer->clientClosed();
+    admission->closeClient();
 }
 
-void runProxy(int port)
+/// Accepts clients and gives each its own thread
+/// @param listener socket to accept from, may be shared with other workers
+void acceptLoop(ClientSocketListener &listener)
 {
-    ClientSocketListener listener(port);
     while (true)
     {
-        ClientSocket sock = listener.acceptClient();
+        std::shared_ptr<const ProxyConfig> config = Config::get();
+        ClientSocket sock = listener.acceptClient(config);
         if (sock.getFD() >= 0)
         {
-            std::thread th(threadRunner, std::move(sock));
+            // Refusing here keeps a flood of connections from turning into a flood of threads
+            if (!admission->openClient(*config))
+            {
+                GFD::threadedCout("Too many clients, refusing connection");
+                sock.send(
+                    HTTPMessage("HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n"));
+                sock.disconnect();
+                continue;
+            }
+            std::thread th(threadRunner, std::move(sock), config);
             th.detach();
         }
     }
 }
 
-int main()
+void runProxy()
+{
+    std::shared_ptr<const ProxyConfig> config = Config::get();
+    // With SO_REUSEPORT the kernel balances connections over one listener per worker,
+    // otherwise every worker accepts from the same listener
+    std::vector<std::unique_ptr<ClientSocketListener>> listeners;
+    for (int i = 0; i < (config->reuse_port ? config->workers : 1); i++)
+    {
+        listeners.push_back(std::make_unique<ClientSocketListener>(*config));
+    }
+    for (int i = 0; i < config->workers; i++)
+    {
+        std::thread th(acceptLoop, std::ref(*listeners[i % listeners.size()]));
+        th.detach();
+    }
+    auto last_save = std::chrono::steady_clock::now();
+    while (true)
+    {
+        std::this_thread::sleep_for(100ms);
+        config = Config::get();
+        if (config->warm_dump_interval_s > 0 &&
+            std::chrono::steady_clock::now() - last_save >= std::chrono::seconds(config->warm_dump_interval_s))
+        {
+            last_save = std::chrono::steady_clock::now();
+            warmer->saveKeys(*config);
+        }
+        if (stats_requested)
+        {
+            stats_requested = 0;
+            cache->logStats();
+            PhaseTimer::logStats();
+            Tunnel::logStats();
+            warmer->logStats();
+            admission->logStats();
+        }
+        if (reload_requested)
+        {
+            reload_requested = 0;
+            if (Config::reload())
+            {
+                GFD::threadedCout("Configuration reloaded, listener and cache sizes apply after a restart");
+            }
+            else
+            {
+                GFD::threadedCout("Configuration reload failed, keeping the current configuration");
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
 {
-    runProxy(8082);
+    if (!Config::load(argc, argv))
+    {
+        return 1;
+    }
+    cache = std::make_unique<CacheStorage>(*Config::get());
+    timers = std::make_unique<TimerWheel>();
+    admission = std::make_unique<AdmissionControl>();
+    warmer = std::make_unique<CacheWarmer>(*cache, *timers, *admission);
+    std::signal(SIGPIPE, SIG_IGN); //Writes to sockets shut down by a deadline must fail instead of ending the process
+    std::signal(SIGUSR1, requestStats);
+    std::signal(SIGHUP, requestReload);
+    warmer->start(*Config::get());
+    runProxy();
     return 0;
 }